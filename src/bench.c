@@ -0,0 +1,528 @@
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "chip8.h"
+#include "fork.h"
+
+#define MAX_RESULTS 256
+#define SYNTHETIC_SIZE 3584         // everything from 0x200 to the end of memory
+#define SPRITE_ROWS 15
+#define BRANCHES 16                 // one branch per key, as a search over the next input would
+
+/*
+ * Benchmarks, four kinds:
+ *   micro/      one handler from instructions.c called in a loop, ns per call
+ *   synthetic/  generated ROMs that each stress one part of the interpreter, ns per instruction
+ *   rom/        the ROMs given on the command line run for a fixed number of frames, ns per frame
+ *   fork/       the same ROMs forked into BRANCHES branches that run --branch-frames frames each through
+ *               chip8_eval_branches, ns per fork and ns per branch frame
+ * Every benchmark is run --repeat times and the fastest run is kept, which is the least disturbed by the host.
+ * Lower is better for all of them.
+ */
+typedef struct Result
+{
+    char name[128];
+    const char *unit;
+    double value;
+    long long count;                // calls, instructions or frames per run
+} Result;
+
+typedef struct MicroBench
+{
+    const char *name;
+    void (*handler)(Chip8 *chip8);
+    unsigned short opcode;
+    unsigned char vx;               // V0, V1 and V2 before the loop
+    unsigned char vy;
+    unsigned char vz;
+    int with_program;               // attach a Program, so memory writes pay for invalidation
+} MicroBench;
+
+static const MicroBench micro_benches[] =
+{
+    { "cls",                    cls,        0x00E0, 0,   0,  0, 0 },
+    { "ld_Vx",                  ld_Vx,      0x6A42, 0,   0,  0, 0 },
+    { "add_Vx_Vy",              add_Vx_Vy,  0x8014, 200, 100, 0, 0 },
+    { "shr",                    shr,        0x8016, 0xB5, 0, 0, 0 },
+    { "se_Vx_kk",               se_Vx_kk,   0x30C8, 200, 0,  0, 0 },
+    { "rnd",                    rnd,        0xC0FF, 0,   0,  0, 0 },
+    { "drw_15_rows",            drw,        0xD01F, 20,  8,  0, 0 },
+    { "drw_15_rows_clipped",    drw,        0xD01F, 60,  26, 0, 0 },
+    { "drw_wrap_15_rows",       drw_wrap,   0xD01F, 60,  26, 0, 0 },
+    { "ld_F_Vx",                ld_F_Vx,    0xF229, 0,   0,  7, 0 },
+    { "ld_bcd_Vx",              ld_bcd_Vx,  0xF033, 234, 0,  0, 0 },
+    { "ld_bcd_Vx_program",      ld_bcd_Vx,  0xF033, 234, 0,  0, 1 },
+    { "ld_regs_Vx_F",           ld_regs_Vx, 0xFF55, 1,   2,  3, 0 },
+    { "ld_regs_Vx_F_program",   ld_regs_Vx, 0xFF55, 1,   2,  3, 1 },
+    { "ld_Vx_regs_F",           ld_Vx_regs, 0xFF65, 0,   0,  0, 0 },
+};
+
+Result results[MAX_RESULTS];
+int result_count;
+int repeat = 5;
+long long micro_iterations = 2000000;
+long long synthetic_instructions = 20000000;
+long long rom_frames = 5000000;
+long branch_frames = 60;
+int branch_threads = 1;
+
+Chip8 machine;
+Program program;
+Chip8 branches[BRANCHES];
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_result(const char *kind, const char *name, const char *unit, double value, long long count) {
+    if(result_count == MAX_RESULTS) {
+        return;
+    }
+    Result *result = &results[result_count++];
+    snprintf(result->name, sizeof(result->name), "%s/%s", kind, name);
+    result->unit = unit;
+    result->value = value;
+    result->count = count;
+    printf("%-40s %10.3f %s\n", result->name, value, unit);
+}
+
+static void run_micro(const MicroBench *bench) {
+    double best = 0;
+
+    for(int r = 0; r < repeat; r++) {
+        initialize_chip8(&machine);
+        machine.rng = 1;
+        machine.V[0] = bench->vx;
+        machine.V[1] = bench->vy;
+        machine.V[2] = bench->vz;
+        machine.I = 0x300;
+        memset(&machine.memory[0x300], 0xA5, SPRITE_ROWS);
+        if(bench->with_program) {
+            program_build(&program, &machine);
+            machine.program = &program;
+        }
+        // handlers are called through a pointer, as the interpreter's dispatch does
+        void (*volatile handler)(Chip8 *) = bench->handler;
+
+        double start = now_seconds();
+        for(long long i = 0; i < micro_iterations; i++) {
+            machine.opcode = bench->opcode;
+            handler(&machine);
+        }
+        double seconds = now_seconds() - start;
+        if(r == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    add_result("micro", bench->name, "ns/op", best * 1e9 / micro_iterations, micro_iterations);
+}
+
+/*
+ * Synthetic ROMs. Each is a loop of generated instructions that never faults and runs forever, so it can be run for
+ * any number of instructions. The generator is seeded, the same ROM is built on every run.
+ */
+static uint32_t generator_state;
+
+static uint32_t next_random(void) {
+    generator_state ^= generator_state << 13;
+    generator_state ^= generator_state >> 17;
+    generator_state ^= generator_state << 5;
+    return generator_state;
+}
+
+static int emit_op(unsigned char *rom, int at, unsigned short opcode) {
+    rom[at] = opcode >> 8;
+    rom[at + 1] = opcode & 0xFF;
+    return at + 2;
+}
+
+// straight line register arithmetic, every instruction goes through the decoder
+static int generate_decode(unsigned char *rom) {
+    static const unsigned short alu[] = { 0x8000, 0x8001, 0x8002, 0x8003, 0x8004, 0x8005, 0x8006, 0x8007, 0x800E };
+    int at = 0;
+
+    for(int i = 0; i < 600; i++) {
+        int x = next_random() % 15;
+        int y = next_random() % 15;
+        switch(next_random() % 4) {
+            case 0:
+                at = emit_op(rom, at, 0x6000 | x << 8 | (next_random() & 0xFF));
+                break;
+            case 1:
+                at = emit_op(rom, at, 0x7000 | x << 8 | (next_random() & 0xFF));
+                break;
+            default:
+                at = emit_op(rom, at, alu[next_random() % 9] | x << 8 | y << 4);
+                break;
+        }
+    }
+    return emit_op(rom, at, 0x1200);
+}
+
+// skips taken and not taken about evenly, and calls to a subroutine kept in front of the loop
+static int generate_branch(unsigned char *rom) {
+    const unsigned short subroutine = 0x202;
+    const unsigned short loop = 0x206;
+    int at = 0;
+
+    at = emit_op(rom, at, 0x1000 | loop);
+    at = emit_op(rom, at, 0x7E01);
+    at = emit_op(rom, at, 0x00EE);
+    for(int i = 0; i < 300; i++) {
+        int x = next_random() % 15;
+        int y = next_random() % 15;
+        switch(next_random() % 6) {
+            case 0:
+                at = emit_op(rom, at, 0x3000 | x << 8 | (next_random() & 0x01));
+                break;
+            case 1:
+                at = emit_op(rom, at, 0x4000 | x << 8 | (next_random() & 0x01));
+                break;
+            case 2:
+                at = emit_op(rom, at, 0x5000 | x << 8 | y << 4);
+                break;
+            case 3:
+                at = emit_op(rom, at, 0x9000 | x << 8 | y << 4);
+                break;
+            case 4:
+                at = emit_op(rom, at, 0x2000 | subroutine);
+                continue;
+            default:
+                at = emit_op(rom, at, 0x6000 | x << 8 | (next_random() & 0x01));
+                continue;
+        }
+        // the instruction a skip jumps over
+        at = emit_op(rom, at, 0x7000 | (next_random() % 15) << 8 | 0x01);
+    }
+    return emit_op(rom, at, 0x1000 | loop);
+}
+
+// BCD and register stores and loads over a data area well past the code
+static int generate_memory(unsigned char *rom) {
+    int at = 0;
+
+    for(int i = 0; i < 300; i++) {
+        int x = next_random() % 16;
+        at = emit_op(rom, at, 0xA000 | (0xE00 + (next_random() % 240)));
+        switch(next_random() % 4) {
+            case 0:
+                at = emit_op(rom, at, 0xF033 | x << 8);
+                break;
+            case 1:
+                at = emit_op(rom, at, 0xF055 | x << 8);
+                break;
+            case 2:
+                at = emit_op(rom, at, 0xF065 | x << 8);
+                break;
+            default:
+                at = emit_op(rom, at, 0xF01E | x << 8);
+                break;
+        }
+    }
+    return emit_op(rom, at, 0x1200);
+}
+
+// 15 row sprites and font digits all over the display, with the odd clear
+static int generate_draw(unsigned char *rom) {
+    const int body = 150;
+    const unsigned short sprite = 0x200 + body * 8 + 2;
+    int at = 0;
+
+    for(int i = 0; i < body; i++) {
+        at = emit_op(rom, at, 0x6000 | (next_random() & 0x3F));
+        at = emit_op(rom, at, 0x6100 | (next_random() & 0x1F));
+        switch(next_random() % 8) {
+            case 0:
+                at = emit_op(rom, at, 0x00E0);
+                at = emit_op(rom, at, 0x6200 | (next_random() & 0x0F));
+                break;
+            case 1:
+            case 2:
+                at = emit_op(rom, at, 0xF229);
+                at = emit_op(rom, at, 0xD015);
+                break;
+            default:
+                at = emit_op(rom, at, 0xA000 | sprite);
+                at = emit_op(rom, at, 0xD01F);
+                break;
+        }
+    }
+    at = emit_op(rom, at, 0x1200);
+    for(int row = 0; row < SPRITE_ROWS; row++) {
+        rom[at++] = next_random() & 0xFF;
+    }
+    return at;
+}
+
+typedef struct SyntheticRom
+{
+    const char *name;
+    int (*generate)(unsigned char *rom);
+} SyntheticRom;
+
+static const SyntheticRom synthetic_roms[] =
+{
+    { "decode", generate_decode },
+    { "branch", generate_branch },
+    { "memory", generate_memory },
+    { "draw",   generate_draw },
+};
+
+// fastest of the repeats, in ns per instruction
+static double run_machine(const Chip8 *loaded, long long instructions, long long *done) {
+    run_fn run = select_runner(loaded->quirks);
+    double best = 0;
+
+    for(int r = 0; r < repeat; r++) {
+        machine = *loaded;
+        program_build(&program, &machine);
+        machine.program = &program;
+
+        double start = now_seconds();
+        *done = run(&machine, instructions);
+        double seconds = now_seconds() - start;
+        if(r == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    return *done > 0 ? best * 1e9 / *done : 0;
+}
+
+static void run_synthetic(const SyntheticRom *synthetic, const char *emit_dir) {
+    static Chip8 loaded;
+    unsigned char rom[SYNTHETIC_SIZE];
+    long long done;
+
+    memset(rom, 0, sizeof(rom));
+    generator_state = 0x9E3779B9;
+    int size = synthetic->generate(rom);
+
+    if(emit_dir != NULL) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s.ch8", emit_dir, synthetic->name);
+        FILE *file = fopen(path, "wb");
+        if(file == NULL || fwrite(rom, 1, size, file) != (size_t)size) {
+            printf("Cannot write %s\n", path);
+        }
+        if(file != NULL) {
+            fclose(file);
+        }
+    }
+
+    initialize_chip8(&loaded);
+    memcpy(&loaded.memory[PC_START], rom, size);
+    loaded.rng = 1;
+    double value = run_machine(&loaded, synthetic_instructions, &done);
+    add_result("synthetic", synthetic->name, "ns/instruction", value, done);
+}
+
+static void run_rom(const char *path) {
+    static Chip8 loaded;
+    long long done;
+
+    initialize_chip8(&loaded);
+    load_rom(&loaded, path);
+    loaded.rng = 1;
+    double value = run_machine(&loaded, rom_frames, &done);
+
+    const char *name = strrchr(path, '/');
+    add_result("rom", name != NULL ? name + 1 : path, "ns/frame", value, done);
+}
+
+/*
+ * Fork cost on its own, then whole evaluations of BRANCHES key masks from a root that has run for a while, so the
+ * branches start from a screen and memory the ROM has set up. The evaluations run rom_frames branch frames in total.
+ */
+static void run_fork(const char *path) {
+    static Chip8 root;
+    unsigned short keys[BRANCHES];
+    run_fn run = select_runner(0);
+    long long forks = micro_iterations;
+    long long evaluations = rom_frames / (BRANCHES * branch_frames);
+    double best_fork = 0, best_eval = 0;
+
+    if(evaluations < 1) {
+        evaluations = 1;
+    }
+    initialize_chip8(&root);
+    load_rom(&root, path);
+    root.rng = 1;
+    run(&root, 10000);
+    for(int k = 0; k < BRANCHES; k++) {
+        keys[k] = 1 << k;
+    }
+
+    for(int r = 0; r < repeat; r++) {
+        double start = now_seconds();
+        for(long long i = 0; i < forks; i++) {
+            chip8_fork(&branches[i % BRANCHES], &root);
+            // keeps the copy from being dropped as dead
+            __asm__ volatile("" : : "r"(&branches[i % BRANCHES]) : "memory");
+        }
+        double seconds = now_seconds() - start;
+        if(r == 0 || seconds < best_fork) {
+            best_fork = seconds;
+        }
+
+        start = now_seconds();
+        for(long long i = 0; i < evaluations; i++) {
+            chip8_eval_branches(&root, run, keys, branches, BRANCHES, branch_frames, branch_threads);
+        }
+        seconds = now_seconds() - start;
+        if(r == 0 || seconds < best_eval) {
+            best_eval = seconds;
+        }
+    }
+
+    const char *name = strrchr(path, '/');
+    char label[128];
+    long long branch_frame_count = evaluations * BRANCHES * branch_frames;
+    snprintf(label, sizeof(label), "%s/copy", name != NULL ? name + 1 : path);
+    add_result("fork", label, "ns/fork", best_fork * 1e9 / forks, forks);
+    snprintf(label, sizeof(label), "%s/eval_%dx%ld", name != NULL ? name + 1 : path, BRANCHES, branch_frames);
+    add_result("fork", label, "ns/branch-frame", best_eval * 1e9 / branch_frame_count, branch_frame_count);
+    printf("%s: forks/s=%.0f branch-frames/s=%.0f (%d branches x %ld frames, %d thread%s)\n",
+           name != NULL ? name + 1 : path, forks / best_fork, branch_frame_count / best_eval, BRANCHES, branch_frames,
+           branch_threads, branch_threads == 1 ? "" : "s");
+}
+
+static int write_json(const char *path) {
+    FILE *file = fopen(path, "w");
+    if(file == NULL) {
+        printf("Cannot write %s\n", path);
+        return -1;
+    }
+    // one benchmark per line, which is also what --compare reads
+    fprintf(file, "{\n  \"version\": 1,\n  \"repeat\": %d,\n  \"benchmarks\": [\n", repeat);
+    for(int i = 0; i < result_count; i++) {
+        fprintf(file, "    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.4f, \"count\": %lld}%s\n", results[i].name,
+                results[i].unit, results[i].value, results[i].count, i + 1 < result_count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+static int read_json(const char *path, Result *out, int max) {
+    FILE *file = fopen(path, "r");
+    char line[512];
+    int count = 0;
+
+    if(file == NULL) {
+        return -1;
+    }
+    while(fgets(line, sizeof(line), file) != NULL && count < max) {
+        char *name = strstr(line, "\"name\": \"");
+        char *value = strstr(line, "\"value\": ");
+        if(name == NULL || value == NULL) {
+            continue;
+        }
+        name += strlen("\"name\": \"");
+        char *end = strchr(name, '"');
+        if(end == NULL || end - name >= (long)sizeof(out[count].name)) {
+            continue;
+        }
+        memcpy(out[count].name, name, end - name);
+        out[count].name[end - name] = '\0';
+        out[count].value = strtod(value + strlen("\"value\": "), NULL);
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+// returns the number of benchmarks that got slower by more than threshold percent
+static int compare(const char *baseline_path, const char *current_path, double threshold) {
+    static Result baseline[MAX_RESULTS], current[MAX_RESULTS];
+    int baseline_count = read_json(baseline_path, baseline, MAX_RESULTS);
+    int current_count = read_json(current_path, current, MAX_RESULTS);
+    int regressions = 0;
+
+    if(baseline_count < 0 || current_count < 0) {
+        printf("Cannot read %s\n", baseline_count < 0 ? baseline_path : current_path);
+        return -1;
+    }
+
+    for(int i = 0; i < current_count; i++) {
+        int b = 0;
+        while(b < baseline_count && strcmp(baseline[b].name, current[i].name) != 0) {
+            b++;
+        }
+        if(b == baseline_count) {
+            printf("%-40s %10s %10.3f   new\n", current[i].name, "-", current[i].value);
+            continue;
+        }
+        double change = baseline[b].value > 0 ? (current[i].value - baseline[b].value) * 100 / baseline[b].value : 0;
+        int regressed = change > threshold;
+        regressions += regressed;
+        printf("%-40s %10.3f %10.3f %+7.1f%%%s\n", current[i].name, baseline[b].value, current[i].value, change,
+               regressed ? "  REGRESSION" : "");
+    }
+    printf("%d of %d benchmarks regressed by more than %.1f%%\n", regressions, current_count, threshold);
+    return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+    char *rom_files[MAX_RESULTS];
+    int rom_count = 0;
+    char *out_file = "bench.json";
+    char *emit_dir = NULL;
+    char *compare_files[2] = { NULL, NULL };
+    double threshold = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_file = argv[++i];
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            micro_iterations = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc) {
+            synthetic_instructions = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            rom_frames = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--branch-frames") == 0 && i + 1 < argc) {
+            branch_frames = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            branch_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--emit") == 0 && i + 1 < argc) {
+            emit_dir = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 2 < argc) {
+            compare_files[0] = argv[++i];
+            compare_files[1] = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = strtod(argv[++i], NULL);
+        } else if (rom_count < MAX_RESULTS) {
+            rom_files[rom_count++] = argv[i];
+        }
+    }
+
+    if (compare_files[0] != NULL) {
+        int regressions = compare(compare_files[0], compare_files[1], threshold);
+        return regressions == 0 ? 0 : 1;
+    }
+
+    if (repeat < 1 || micro_iterations < 1 || synthetic_instructions < 1 || rom_frames < 1 || branch_frames < 1) {
+        printf("Program Usage: ./chip8-bench [--out file] [--repeat n] [--iterations n] [--instructions n] "
+               "[--frames n] [--branch-frames n] [--threads n] [--emit dir] [path/to/rom...]\n"
+               "               ./chip8-bench --compare baseline.json current.json [--threshold percent]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < sizeof(micro_benches) / sizeof(micro_benches[0]); i++) {
+        run_micro(&micro_benches[i]);
+    }
+    for (size_t i = 0; i < sizeof(synthetic_roms) / sizeof(synthetic_roms[0]); i++) {
+        run_synthetic(&synthetic_roms[i], emit_dir);
+    }
+    for (int i = 0; i < rom_count; i++) {
+        run_rom(rom_files[i]);
+    }
+    for (int i = 0; i < rom_count; i++) {
+        run_fork(rom_files[i]);
+    }
+
+    return write_json(out_file) == 0 ? 0 : 1;
+}
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "chip8.h"
 
 void load_rom(Chip8 *chip8, const char *rom_file) {
@@ -49,6 +50,13 @@ void initialize_chip8(Chip8 *chip8) {
     chip8->delay_timer = 0;
     chip8->draw_flag = 0;
     chip8->is_key_pressed = 0;
+    chip8->quirks = 0;
+    chip8->fault = FAULT_NONE;
+    chip8->rng = (unsigned int)time(NULL) | 1;
+    chip8->coverage = NULL;
+    chip8->program = NULL;
+    chip8->latency = NULL;
+    chip8->metrics = NULL;
 
     // clearing the display
     for(int i = 0; i < 64; i++) {
@@ -83,9 +91,33 @@ void initialize_chip8(Chip8 *chip8) {
     }
 }
 
-void emulate_cycle(Chip8 *chip8) {
+// opcode tracing, build with -DCHIP8_DEBUG to print every decoded instruction
+#ifdef CHIP8_DEBUG
+#define LOG_OP(name) printf(name "\n")
+#else
+#define LOG_OP(name)
+#endif
+
+// select the quirk variant of a handler, quirks is a constant in every interpreter variant so this folds away
+#define QUIRK(quirks, flag, with, without) (((quirks) & (flag)) ? with : without)
+
+static inline void update_timers(Chip8 *chip8) {
+    if(chip8->delay_timer > 0) {
+        --chip8->delay_timer;
+    }
+
+    if(chip8->sound_timer > 0) {
+        --chip8->sound_timer;
+    }
+}
+
+static inline __attribute__((always_inline)) void dispatch(Chip8 *chip8, const unsigned char quirks) {
     // fetch opcode from the rom memory which is at PC and PC + 1 (opcode is of 3 bytes)
-    chip8->opcode = chip8->memory[chip8->PC] << 8 | chip8->memory[chip8-> PC + 1];
+    chip8->opcode = chip8->memory[chip8->PC & ADDR_MASK] << 8 | chip8->memory[(chip8->PC + 1) & ADDR_MASK];
+
+    if(chip8->coverage) {
+        coverage_mark(chip8->coverage->executed, chip8->PC);
+    }
 
     // decode the opcode
     // CHIP-8’s index register and program counter can only address 12 bits (conveniently), which is 4096 addresses.
@@ -93,304 +125,342 @@ void emulate_cycle(Chip8 *chip8) {
         case 0x0000:
             switch (chip8->opcode & 0x00FF) {
                 case 0x00E0:
-                    printf("CLS\n");
+                    LOG_OP("CLS");
                     cls(chip8);
                     break;
                 case 0x0EE:
-                    printf("RET\n");
+                    LOG_OP("RET");
                     ret(chip8);
                     break;
                 default:
-                    exit(EXIT_FAILURE);
+                    chip8->fault = FAULT_ILLEGAL_OPCODE;
+                    return;
             }
             break;
         case 0x1000:
-            printf("JP addr\n");
+            LOG_OP("JP addr");
             jmp(chip8);
             break;
         case 0x2000:
-            printf("CALL addr\n");
+            LOG_OP("CALL addr");
             call(chip8);
             break;
         case 0x3000:
-            printf("SE Vx, byte\n");
+            LOG_OP("SE Vx, byte");
             se_Vx_kk(chip8);
             break;
         case 0x4000:
-            printf("SNE Vx, byte\n");
+            LOG_OP("SNE Vx, byte");
             sne_Vx_kk(chip8);
             break;
         case 0x5000:
-            printf("SE Vx, Vy\n");
+            LOG_OP("SE Vx, Vy");
             se_Vx_Vy(chip8);
             break;
         case 0x6000:
-            printf("LD Vx, byte\n");
+            LOG_OP("LD Vx, byte");
             ld_Vx(chip8);
             break;
         case 0x7000:
-            printf("ADD Vx, byte\n");
+            LOG_OP("ADD Vx, byte");
             add_Vx_kk(chip8);
             break;
         case 0x8000:
             switch (chip8->opcode & 0xF00F) {
                 case 0x8000:
-                    printf("LD Vx, Vy\n");
+                    LOG_OP("LD Vx, Vy");
                     ld_Vx_Vy(chip8);
                     break;
                 case 0x8001:
-                    printf("OR Vx, Vy\n");
-                    or_Vx_Vy(chip8);
+                    LOG_OP("OR Vx, Vy");
+                    QUIRK(quirks, QUIRK_VF_RESET, or_Vx_Vy_vf_reset, or_Vx_Vy)(chip8);
                     break;
                 case 0x8002:
-                    printf("AND Vx, Vy\n");
-                    and_Vx_Vy(chip8);
+                    LOG_OP("AND Vx, Vy");
+                    QUIRK(quirks, QUIRK_VF_RESET, and_Vx_Vy_vf_reset, and_Vx_Vy)(chip8);
                     break;
                 case 0x8003:
-                    printf("XOR Vx, Vy\n");
-                    xor_Vx_Vy(chip8);
+                    LOG_OP("XOR Vx, Vy");
+                    QUIRK(quirks, QUIRK_VF_RESET, xor_Vx_Vy_vf_reset, xor_Vx_Vy)(chip8);
                     break;
                 case 0x8004:
-                    printf("ADD Vx, Vy\n");
+                    LOG_OP("ADD Vx, Vy");
                     add_Vx_Vy(chip8);
                     break;
                 case 0x8005:
-                    printf("SUB Vx, Vy\n");
+                    LOG_OP("SUB Vx, Vy");
                     sub_Vx_Vy(chip8);
                     break;
                 case 0x8006:
-                    printf("SHR Vx {, Vy}\n");
-                    shr(chip8);
+                    LOG_OP("SHR Vx {, Vy}");
+                    QUIRK(quirks, QUIRK_SHIFT_VY, shr_Vy, shr)(chip8);
                     break;
                 case 0x8007:
-                    printf("SUBN Vx, Vy\n");
+                    LOG_OP("SUBN Vx, Vy");
                     subn_Vx_Vy(chip8);
                     break;
                 case 0x800E:
-                    printf("SHL Vx {, Vy}\n");
-                    shl(chip8);
+                    LOG_OP("SHL Vx {, Vy}");
+                    QUIRK(quirks, QUIRK_SHIFT_VY, shl_Vy, shl)(chip8);
                     break;
                 default:
-                    exit(EXIT_FAILURE);
+                    chip8->fault = FAULT_ILLEGAL_OPCODE;
+                    return;
             }
             break;
         case 0x9000:
-            printf("SNE Vx, Vy\n");
+            LOG_OP("SNE Vx, Vy");
             sne_Vx_Vy(chip8);
             break;
         case 0xA000:
-            printf("LD I, addr\n");
+            LOG_OP("LD I, addr");
             ldi(chip8);
             break;
         case 0xB000:
-            printf("JP V0, addr\n");
-            jmp_V0(chip8);
+            LOG_OP("JP V0, addr");
+            QUIRK(quirks, QUIRK_JUMP_VX, jmp_Vx, jmp_V0)(chip8);
             break;
         case 0xC000:
-            printf("RND Vx, byte\n");
+            LOG_OP("RND Vx, byte");
             rnd(chip8);
             break;
         case 0xD000:
-            printf("DRW Vx, Vy, nibble\n");
-            drw(chip8);
+            LOG_OP("DRW Vx, Vy, nibble");
+            QUIRK(quirks, QUIRK_DRAW_WRAP, drw_wrap, drw)(chip8);
             break;
         case 0xE000:
             switch (chip8->opcode & 0xF0FF) {
                 case 0xE09E:
-                    printf("SKP Vx\n");
+                    LOG_OP("SKP Vx");
                     skp(chip8);
                     break;
                 case 0xE0A1:
-                    printf("SKNP Vx\n");
+                    LOG_OP("SKNP Vx");
                     sknp(chip8);
                     break;
                 default:
-                    exit(EXIT_FAILURE);
+                    chip8->fault = FAULT_ILLEGAL_OPCODE;
+                    return;
             }
             break;
         case 0xF000:
             switch (chip8->opcode & 0xF0FF) {
                 case 0xF007:
-                    printf("LD Vx, DT\n");
+                    LOG_OP("LD Vx, DT");
                     ld_Vx_dt(chip8);
                     break;
                 case 0xF00A:
-                    printf("LD Vx, K\n");
+                    LOG_OP("LD Vx, K");
                     ld_Vx_key(chip8);
                     break;
                 case 0xF015:
-                    printf("LD DT, Vx\n");
+                    LOG_OP("LD DT, Vx");
                     ld_dt_Vx(chip8);
                     break;
                 case 0xF018:
-                    printf("LD ST, Vx\n");
+                    LOG_OP("LD ST, Vx");
                     ld_st_Vx(chip8);
                     break;
                 case 0xF01E:
-                    printf("ADD I, Vx\n");
+                    LOG_OP("ADD I, Vx");
                     add_i_Vx(chip8);
                     break;
                 case 0xF029:
-                    printf("LD F, Vx\n");
+                    LOG_OP("LD F, Vx");
                     ld_F_Vx(chip8);
                     break;
                 case 0xF033:
-                    printf("LD B, Vx\n");
+                    LOG_OP("LD B, Vx");
                     ld_bcd_Vx(chip8);
                     break;
                 case 0xF055:
-                    printf("LD [I], Vx\n");
-                    ld_regs_Vx(chip8);
+                    LOG_OP("LD [I], Vx");
+                    QUIRK(quirks, QUIRK_LOAD_STORE_I, ld_regs_Vx_inc, ld_regs_Vx)(chip8);
                     break;
                 case 0xF065:
-                    printf("LD Vx, [I]\n");
-                    ld_Vx_regs(chip8);
+                    LOG_OP("LD Vx, [I]");
+                    QUIRK(quirks, QUIRK_LOAD_STORE_I, ld_Vx_regs_inc, ld_Vx_regs)(chip8);
                     break;
                 default:
-                    exit(EXIT_FAILURE);
+                    chip8->fault = FAULT_ILLEGAL_OPCODE;
+                    return;
             }
             break;
         default:
-            exit(EXIT_FAILURE);
+            chip8->fault = FAULT_ILLEGAL_OPCODE;
+            return;
     }
 
-    // update timers
-    if(chip8->delay_timer > 0) {
-        --chip8->delay_timer;
+    // a faulting instruction leaves the machine as it was before it
+    if(chip8->fault) {
+        return;
     }
 
-    if(chip8->sound_timer > 0) {
-        if(chip8->sound_timer == 1) {
-            printf("BEEP\n");
-        }
-        --chip8->sound_timer;
-    }
+    update_timers(chip8);
 }
 
 /*
- *  Keypad                   Keyboard
- * +-+-+-+-+                +-+-+-+-+
- * |1|2|3|C|                |1|2|3|4|
- * +-+-+-+-+                +-+-+-+-+
- * |4|5|6|D|                |Q|W|E|R|
- * +-+-+-+-+       =>       +-+-+-+-+
- * |7|8|9|E|                |A|S|D|F|
- * +-+-+-+-+                +-+-+-+-+
- * |A|0|B|F|                |Z|X|C|V|
- * +-+-+-+-+                +-+-+-+-+
- * 
- * The above is the mapping for the chip8 hex keypad to keyboard
+ * Superinstructions. Each one has exactly the effect of the instructions it replaces, timers included, and
+ * returns how many of them it ran.
  */
-void handle_input(Chip8 *chip8) {
-    if(IsKeyDown(KEY_ONE)) {
-        printf("1 key pressed\n");
-        chip8->key[0x0] = 1;
-    } else if(IsKeyUp(KEY_ONE)) {
-        chip8->key[0x0] = 0;
-    }
-
-    if(IsKeyDown(KEY_TWO)) {
-        printf("2 key pressed\n");
-        chip8->key[0x1] = 1;
-    } else if(IsKeyUp(KEY_TWO)) {
-        chip8->key[0x1] = 0;
-    }
-
-    if(IsKeyDown(KEY_THREE)) {
-        printf("3 key pressed\n");
-        chip8->key[0x2] = 1;
-    } else if(IsKeyUp(KEY_THREE)) {
-        chip8->key[0x2] = 0;
-    }
-
-    if(IsKeyDown(KEY_FOUR)) {
-        printf("4 key pressed\n");
-        chip8->key[0x3] = 1;
-    } else if(IsKeyUp(KEY_FOUR)) {
-        chip8->key[0x3] = 0;
-    }
-
-    if(IsKeyDown(KEY_Q)) {
-        printf("Q key pressed\n");
-        chip8->key[0x4] = 1;
-    } else if(IsKeyUp(KEY_Q)) {
-        chip8->key[0x4] = 0;
-    }
-
-    if(IsKeyDown(KEY_W)) {
-        printf("W key pressed\n");
-        chip8->key[0x5] = 1;
-    } else if(IsKeyUp(KEY_W)) {
-        chip8->key[0x5] = 0;
-    }
-
-    if(IsKeyDown(KEY_E)) {
-        printf("E key pressed\n");
-        chip8->key[0x6] = 1;
-    } else if(IsKeyUp(KEY_E)) {
-        chip8->key[0x6] = 0;
-    }
-
-    if(IsKeyDown(KEY_R)) {
-        printf("R key pressed\n");
-        chip8->key[0x7] = 1;
-    } else if(IsKeyUp(KEY_R)) {
-        chip8->key[0x7] = 0;
-    }
-
-    if(IsKeyDown(KEY_A)) {
-        printf("A key pressed\n");
-        chip8->key[0x8] = 1;
-    } else if(IsKeyUp(KEY_A)) {
-        chip8->key[0x8] = 0;
+static inline __attribute__((always_inline)) int run_fused(Chip8 *chip8, Program *program, unsigned char kind,
+                                                           const unsigned char quirks) {
+    unsigned short pc = chip8->PC & ADDR_MASK;
+    uint16_t first = program->opcode[pc];
+    uint16_t second = program->opcode[pc + 2];
+    uint16_t third;
+    int length = program->length[pc];
+    int ran = length;
+
+    program->fired[kind]++;
+
+    switch(kind) {
+        case FUSE_LDI_DRW:
+            chip8->I = first & 0x0FFF;
+            chip8->PC += 2;
+            update_timers(chip8);
+            chip8->opcode = second;
+            QUIRK(quirks, QUIRK_DRAW_WRAP, drw_wrap, drw)(chip8);
+            update_timers(chip8);
+            break;
+        case FUSE_LD_RUN:
+            for(int i = 0; i < length; i++) {
+                chip8->opcode = program->opcode[pc + 2 * i];
+                chip8->V[(chip8->opcode & 0x0F00) >> 8] = chip8->opcode & 0x00FF;
+                update_timers(chip8);
+            }
+            chip8->PC += 2 * length;
+            break;
+        case FUSE_TIMER_POLL:
+        case FUSE_COUNT_LOOP:
+            if(kind == FUSE_TIMER_POLL) {
+                chip8->V[(first & 0x0F00) >> 8] = chip8->delay_timer;
+            } else {
+                chip8->V[(first & 0x0F00) >> 8] += first & 0x00FF;
+            }
+            update_timers(chip8);
+            chip8->opcode = second;
+            update_timers(chip8);
+            if(chip8->V[(second & 0x0F00) >> 8] == (second & 0x00FF)) {
+                // the jump is skipped
+                chip8->PC += 6;
+                ran = 2;
+            } else {
+                third = program->opcode[pc + 4];
+                chip8->opcode = third;
+                chip8->PC = third & 0x0FFF;
+                update_timers(chip8);
+                if(kind == FUSE_TIMER_POLL && chip8->PC == pc && chip8->metrics) {
+                    metrics_add(&chip8->metrics->idle, 3);
+                }
+            }
+            break;
     }
 
-    if(IsKeyDown(KEY_S)) {
-        printf("S key pressed\n");
-        chip8->key[0x9] = 1;
-    } else if(IsKeyUp(KEY_S)) {
-        chip8->key[0x9] = 0;
+    if(chip8->coverage) {
+        for(int i = 0; i < ran; i++) {
+            coverage_mark(chip8->coverage->executed, pc + 2 * i);
+        }
     }
+    return ran;
+}
 
-    if(IsKeyDown(KEY_D)) {
-        printf("D key pressed\n");
-        chip8->key[0xA] = 1;
-    } else if(IsKeyUp(KEY_D)) {
-        chip8->key[0xA] = 0;
+/*
+ * Run up to cycles instructions, stopping early on a fault, and return how many ran.
+ * With a Program attached, a superinstruction is used whenever all the instructions it may cover fit in what is
+ * left of cycles, so the count and the machine state always match running the instructions one by one.
+ */
+static inline __attribute__((always_inline)) long run(Chip8 *chip8, long cycles, const unsigned char quirks) {
+    Program *program = chip8->program;
+    long done = 0;
+
+    while(done < cycles && !chip8->fault) {
+        if(program) {
+            unsigned short pc = chip8->PC & ADDR_MASK;
+            unsigned char kind = program->fuse[pc];
+            if(kind && cycles - done >= program->length[pc]) {
+                done += run_fused(chip8, program, kind, quirks);
+                continue;
+            }
+        }
+        dispatch(chip8, quirks);
+        done += !chip8->fault;
     }
+    return done;
+}
 
-    if(IsKeyDown(KEY_F)) {
-        printf("F key pressed\n");
-        chip8->key[0xB] = 1;
-    } else if(IsKeyUp(KEY_F)) {
-        chip8->key[0xB] = 0;
-    }
+/*
+ * One specialized copy of the fetch/decode/execute loop per quirk combination.
+ * dispatch() is always inlined with a constant quirks argument, so each variant calls its handlers directly.
+ */
+#define INTERPRETER_VARIANT(q) \
+    static void emulate_cycle_q##q(Chip8 *chip8) { dispatch(chip8, q); } \
+    static long run_q##q(Chip8 *chip8, long cycles) { return run(chip8, cycles, q); }
+
+INTERPRETER_VARIANT(0)  INTERPRETER_VARIANT(1)  INTERPRETER_VARIANT(2)  INTERPRETER_VARIANT(3)
+INTERPRETER_VARIANT(4)  INTERPRETER_VARIANT(5)  INTERPRETER_VARIANT(6)  INTERPRETER_VARIANT(7)
+INTERPRETER_VARIANT(8)  INTERPRETER_VARIANT(9)  INTERPRETER_VARIANT(10) INTERPRETER_VARIANT(11)
+INTERPRETER_VARIANT(12) INTERPRETER_VARIANT(13) INTERPRETER_VARIANT(14) INTERPRETER_VARIANT(15)
+INTERPRETER_VARIANT(16) INTERPRETER_VARIANT(17) INTERPRETER_VARIANT(18) INTERPRETER_VARIANT(19)
+INTERPRETER_VARIANT(20) INTERPRETER_VARIANT(21) INTERPRETER_VARIANT(22) INTERPRETER_VARIANT(23)
+INTERPRETER_VARIANT(24) INTERPRETER_VARIANT(25) INTERPRETER_VARIANT(26) INTERPRETER_VARIANT(27)
+INTERPRETER_VARIANT(28) INTERPRETER_VARIANT(29) INTERPRETER_VARIANT(30) INTERPRETER_VARIANT(31)
+
+static const emulate_fn interpreter_variants[QUIRK_COUNT] = {
+    emulate_cycle_q0,  emulate_cycle_q1,  emulate_cycle_q2,  emulate_cycle_q3,
+    emulate_cycle_q4,  emulate_cycle_q5,  emulate_cycle_q6,  emulate_cycle_q7,
+    emulate_cycle_q8,  emulate_cycle_q9,  emulate_cycle_q10, emulate_cycle_q11,
+    emulate_cycle_q12, emulate_cycle_q13, emulate_cycle_q14, emulate_cycle_q15,
+    emulate_cycle_q16, emulate_cycle_q17, emulate_cycle_q18, emulate_cycle_q19,
+    emulate_cycle_q20, emulate_cycle_q21, emulate_cycle_q22, emulate_cycle_q23,
+    emulate_cycle_q24, emulate_cycle_q25, emulate_cycle_q26, emulate_cycle_q27,
+    emulate_cycle_q28, emulate_cycle_q29, emulate_cycle_q30, emulate_cycle_q31
+};
+
+static const run_fn runner_variants[QUIRK_COUNT] = {
+    run_q0,  run_q1,  run_q2,  run_q3,  run_q4,  run_q5,  run_q6,  run_q7,
+    run_q8,  run_q9,  run_q10, run_q11, run_q12, run_q13, run_q14, run_q15,
+    run_q16, run_q17, run_q18, run_q19, run_q20, run_q21, run_q22, run_q23,
+    run_q24, run_q25, run_q26, run_q27, run_q28, run_q29, run_q30, run_q31
+};
+
+// pick the interpreter for a quirk combination, meant to be called once after the ROM is loaded
+emulate_fn select_interpreter(unsigned char quirks) {
+    return interpreter_variants[quirks % QUIRK_COUNT];
+}
 
-    if(IsKeyDown(KEY_Z)) {
-        printf("Z key pressed\n");
-        chip8->key[0xC] = 1;
-    } else if(IsKeyUp(KEY_Z)) {
-        chip8->key[0xC] = 0;
-    }
+// as select_interpreter, for running many instructions per call with superinstructions when a Program is attached
+run_fn select_runner(unsigned char quirks) {
+    return runner_variants[quirks % QUIRK_COUNT];
+}
 
-    if(IsKeyDown(KEY_X)) {
-        printf("X key pressed\n");
-        chip8->key[0xD] = 1;
-    } else if(IsKeyUp(KEY_X)) {
-        chip8->key[0xD] = 0;
-    }
+// convenience wrapper that looks up the variant on every call, hot loops should keep select_interpreter()'s result
+void emulate_cycle(Chip8 *chip8) {
+    interpreter_variants[chip8->quirks % QUIRK_COUNT](chip8);
+}
 
-    if(IsKeyDown(KEY_C)) {
-        printf("C key pressed\n");
-        chip8->key[0xE] = 1;
-    } else if(IsKeyUp(KEY_C)) {
-        chip8->key[0xE] = 0;
+static const struct {
+    const char *name;
+    unsigned char quirks;
+} quirk_profiles[] = {
+    { "default", 0 },                                                       // this interpreter's original behaviour
+    { "vip",     QUIRK_SHIFT_VY | QUIRK_LOAD_STORE_I | QUIRK_VF_RESET },    // COSMAC VIP
+    { "schip",   QUIRK_JUMP_VX },                                           // CHIP-48 / SUPER-CHIP
+    { "xochip",  QUIRK_SHIFT_VY | QUIRK_LOAD_STORE_I | QUIRK_DRAW_WRAP },   // XO-CHIP
+};
+
+// returns the QUIRK_* flags of a named profile, or of a numeric mask (0-31), -1 if neither
+int quirks_from_name(const char *name) {
+    for(size_t i = 0; i < sizeof(quirk_profiles) / sizeof(quirk_profiles[0]); i++) {
+        if(strcmp(quirk_profiles[i].name, name) == 0) {
+            return quirk_profiles[i].quirks;
+        }
     }
 
-    if(IsKeyDown(KEY_V)) {
-        printf("V key pressed\n");
-        chip8->key[0xF] = 1;
-    } else if(IsKeyUp(KEY_V)) {
-        chip8->key[0xF] = 0;
+    char *end;
+    long mask = strtol(name, &end, 0);
+    if(*name != '\0' && *end == '\0' && mask >= 0 && mask < QUIRK_COUNT) {
+        return (int)mask;
     }
-}
\ No newline at end of file
+    return -1;
+}
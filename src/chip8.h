@@ -3,12 +3,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include "raylib.h"
 #include "instructions.h"
+#include "quirks.h"
+
+typedef void (*emulate_fn)(Chip8 *chip8);
+typedef long (*run_fn)(Chip8 *chip8, long cycles);
 
 void load_rom(Chip8 *chip8, const char *rom_file);
 void initialize_chip8(Chip8 *chip8);
 void emulate_cycle(Chip8 *chip8);
-void handle_input(Chip8 * chip8);
+emulate_fn select_interpreter(unsigned char quirks);
+run_fn select_runner(unsigned char quirks);
+int quirks_from_name(const char *name);
 
 #endif
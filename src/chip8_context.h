@@ -6,6 +6,8 @@
 #define CHIP8_RAM_END_ADDR 0x1FF
 #define PROGRAM_START_ADDR 0x200
 #define PROGRAM_END_ADDR 0xFFF
+#define ADDR_MASK 0xFFF             // I and PC only address 12 bits, every memory access is masked with this
+#define STACK_DEPTH 15              // stack[0] is never used since call increments SP before pushing
 
 const static unsigned char chip8_fontset[80] =
 { 
@@ -27,6 +29,22 @@ const static unsigned char chip8_fontset[80] =
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+// why a machine stopped, kept in Chip8.fault until the machine is initialized again
+typedef enum Chip8Fault
+{
+    FAULT_NONE = 0,
+    FAULT_ILLEGAL_OPCODE,           // opcode that no CHIP-8 instruction decodes to
+    FAULT_STACK_OVERFLOW,           // call with all STACK_DEPTH levels in use
+    FAULT_STACK_UNDERFLOW,          // ret with an empty stack
+    FAULT_INSTRUCTION_BUDGET,       // sandbox ran out of instructions
+    FAULT_TIME_BUDGET               // sandbox ran out of wall time
+} Chip8Fault;
+
+struct Coverage;
+struct Program;
+struct Latency;
+struct Metrics;
+
 typedef struct Chip8
 {
     unsigned short opcode;          // store the current opcode 2 bytes long
@@ -42,6 +60,13 @@ typedef struct Chip8
     unsigned char key[16];          // keypad
     unsigned char draw_flag;
     unsigned char is_key_pressed;
+    unsigned char quirks;           // QUIRK_* flags the ROM runs with
+    unsigned char fault;            // Chip8Fault, the faulting instruction is not executed and PC stays on it
+    unsigned int rng;               // random number generator state for RND, never 0
+    struct Coverage *coverage;      // memory coverage bitmaps, NULL when not instrumented
+    struct Program *program;        // predecoded ROM used for superinstructions, NULL to interpret every instruction
+    struct Latency *latency;        // input to display latency tracking, NULL when not measured
+    struct Metrics *metrics;        // counters of the thread running the machine, NULL when not collected
 } Chip8;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include "chip8_context.h"
+
+#define COVERAGE_BYTES (4096 / 8)
+
+// one bit per memory address, attached to a machine through Chip8.coverage
+typedef struct Coverage
+{
+    unsigned char executed[COVERAGE_BYTES];     // fetched as the first byte of an instruction
+    unsigned char read[COVERAGE_BYTES];         // read as data by DRW and LD Vx, [I]
+    unsigned char written[COVERAGE_BYTES];      // written by LD B, Vx and LD [I], Vx
+} Coverage;
+
+static inline void coverage_mark(unsigned char *bits, unsigned short addr) {
+    addr &= ADDR_MASK;
+    bits[addr >> 3] |= 1 << (addr & 7);
+}
+
+static inline void coverage_mark_range(unsigned char *bits, unsigned short addr, int n) {
+    for(int i = 0; i < n; i++) {
+        coverage_mark(bits, addr + i);
+    }
+}
+
+#endif
@@ -0,0 +1,152 @@
+#include "display.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// the widest vector kernels the build targets, -DDISPLAY_SCALAR keeps to the plain loops to check them against
+#if !defined(DISPLAY_SCALAR) && defined(__AVX2__)
+#define DISPLAY_AVX2
+#endif
+#if !defined(DISPLAY_SCALAR) && defined(__SSE2__)
+#define DISPLAY_SSE2
+#endif
+
+#if defined(DISPLAY_AVX2) || defined(DISPLAY_SSE2)
+#include <immintrin.h>
+#endif
+
+// foreground/background match the old DrawRectangle(RAYWHITE) on ClearBackground(BLACK) output
+#define FG_LEVEL 245
+#define BG_LEVEL 0
+
+int display_init(Display *display, int scale, int phosphor) {
+    if(scale < 1) {
+        return -1;
+    }
+
+    display->scale = scale;
+    display->width = DISPLAY_WIDTH * scale;
+    display->height = DISPLAY_HEIGHT * scale;
+    // with persistence off a pixel drops straight to black when it is switched off
+    display->decay = (phosphor > 0 && phosphor < 255) ? phosphor : 255;
+
+    display->pixels = (uint32_t *)malloc(sizeof(uint32_t) * display->width * display->height);
+    if(display->pixels == NULL) {
+        return -1;
+    }
+
+    // RGBA8888 in memory order R, G, B, A, which is A << 24 | B << 16 | G << 8 | R on little endian hosts
+    for(int i = 0; i < 256; i++) {
+        uint32_t level = BG_LEVEL + (FG_LEVEL - BG_LEVEL) * i / 255;
+        display->palette[i] = 0xFF000000u | level << 16 | level << 8 | level;
+    }
+
+    memset(display->intensity, 0, sizeof(display->intensity));
+    return 0;
+}
+
+void display_free(Display *display) {
+    free(display->pixels);
+    display->pixels = NULL;
+}
+
+/*
+ * intensity = max(lit ? 255 : 0, intensity - decay) with unsigned saturation.
+ * A lit pixel is always at full brightness, so a sprite that is XORed off and back on within
+ * a few frames never visibly goes dark.
+ */
+static void blend_phosphor(Display *display, const Chip8 *chip8) {
+    const unsigned char *gfx = &chip8->gfx[0][0];
+    unsigned char *intensity = &display->intensity[0][0];
+    int n = DISPLAY_WIDTH * DISPLAY_HEIGHT;
+    int i = 0;
+
+#if defined(DISPLAY_AVX2)
+    __m256i decay = _mm256_set1_epi8((char)display->decay);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i ones = _mm256_set1_epi8((char)0xFF);
+    for(; i < n; i += 32) {
+        __m256i lit = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(gfx + i)), zero), ones);
+        __m256i faded = _mm256_subs_epu8(_mm256_loadu_si256((const __m256i *)(intensity + i)), decay);
+        _mm256_storeu_si256((__m256i *)(intensity + i), _mm256_max_epu8(faded, lit));
+    }
+#elif defined(DISPLAY_SSE2)
+    __m128i decay = _mm_set1_epi8((char)display->decay);
+    __m128i zero = _mm_setzero_si128();
+    __m128i ones = _mm_set1_epi8((char)0xFF);
+    for(; i < n; i += 16) {
+        __m128i lit = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(gfx + i)), zero), ones);
+        __m128i faded = _mm_subs_epu8(_mm_loadu_si128((const __m128i *)(intensity + i)), decay);
+        _mm_storeu_si128((__m128i *)(intensity + i), _mm_max_epu8(faded, lit));
+    }
+#endif
+
+    for(; i < n; i++) {
+        if(gfx[i]) {
+            intensity[i] = 255;
+        } else {
+            intensity[i] = intensity[i] > display->decay ? intensity[i] - display->decay : 0;
+        }
+    }
+}
+
+// write count copies of colour starting at dst
+static inline uint32_t *fill_span(uint32_t *dst, uint32_t colour, int count) {
+    int i = 0;
+
+#if defined(DISPLAY_AVX2)
+    __m256i c8 = _mm256_set1_epi32((int)colour);
+    for(; i + 8 <= count; i += 8) {
+        _mm256_storeu_si256((__m256i *)(dst + i), c8);
+    }
+#endif
+#if defined(DISPLAY_SSE2)
+    __m128i c4 = _mm_set1_epi32((int)colour);
+    for(; i + 4 <= count; i += 4) {
+        _mm_storeu_si128((__m128i *)(dst + i), c4);
+    }
+#endif
+
+    for(; i < count; i++) {
+        dst[i] = colour;
+    }
+    return dst + count;
+}
+
+void display_update(Display *display, const Chip8 *chip8) {
+    int scale = display->scale;
+    int width = display->width;
+
+    blend_phosphor(display, chip8);
+
+    for(int y = 0; y < DISPLAY_HEIGHT; y++) {
+        uint32_t *line = display->pixels + (size_t)y * scale * width;
+        uint32_t *dst = line;
+
+        // expand one source row into the first output line ...
+        for(int x = 0; x < DISPLAY_WIDTH; x++) {
+            dst = fill_span(dst, display->palette[display->intensity[x][y]], scale);
+        }
+
+        // ... then replicate it for the remaining scale - 1 lines
+        for(int i = 1; i < scale; i++) {
+            memcpy(line + (size_t)i * width, line, sizeof(uint32_t) * width);
+        }
+    }
+}
+
+/*
+ * 64 bit FNV-1a over the output buffer.
+ * Lets headless runs compare frames against known good output without keeping the images around.
+ */
+uint64_t display_hash(const Display *display) {
+    const unsigned char *bytes = (const unsigned char *)display->pixels;
+    size_t length = sizeof(uint32_t) * (size_t)display->width * display->height;
+    uint64_t hash = 0xCBF29CE484222325ull;
+
+    for(size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
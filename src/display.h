@@ -0,0 +1,31 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <stdint.h>
+#include "chip8_context.h"
+
+#define DISPLAY_WIDTH 64
+#define DISPLAY_HEIGHT 32
+#define DISPLAY_DEFAULT_PHOSPHOR 48     // intensity lost per frame by a pixel that was switched off
+
+/*
+ * CPU side frame pipeline: gfx -> phosphor blend -> RGBA8888 texture at an integer scale.
+ * The output buffer has no dependency on the frontend, so it can be produced (and hashed) headlessly.
+ */
+typedef struct Display
+{
+    int scale;
+    int width;                              // output width in pixels (64 * scale)
+    int height;                             // output height in pixels (32 * scale)
+    unsigned char decay;                    // phosphor decay per frame, 255 disables persistence
+    uint32_t palette[256];                  // intensity -> RGBA8888 colour
+    uint32_t *pixels;                       // width * height RGBA8888 pixels, rows top to bottom
+    unsigned char intensity[64][32];        // per pixel brightness, same layout as gfx
+} Display;
+
+int display_init(Display *display, int scale, int phosphor);
+void display_free(Display *display);
+void display_update(Display *display, const Chip8 *chip8);
+uint64_t display_hash(const Display *display);
+
+#endif
@@ -0,0 +1,84 @@
+#include "fork.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct EvalJob
+{
+    const Chip8 *root;
+    run_fn run;
+    const unsigned short *keys;
+    Chip8 *branches;
+    int count;
+    long frames;
+    int next;                       // next unclaimed branch, claimed FORK_CHUNK at a time
+} EvalJob;
+
+static void *eval_worker(void *arg) {
+    EvalJob *job = (EvalJob *)arg;
+
+    for(;;) {
+        int first = __atomic_fetch_add(&job->next, FORK_CHUNK, __ATOMIC_RELAXED);
+        if(first >= job->count) {
+            break;
+        }
+        int last = first + FORK_CHUNK < job->count ? first + FORK_CHUNK : job->count;
+
+        for(int b = first; b < last; b++) {
+            Chip8 *chip8 = &job->branches[b];
+            chip8_fork(chip8, job->root);
+            // branches run on other threads than the root, whose metrics shard only its own thread may write
+            chip8->metrics = NULL;
+            // nor may they share its Program, which counts and invalidates superinstructions without locking
+            chip8->program = NULL;
+            // and the root's key press tracking is only followed on its own thread
+            chip8->latency = NULL;
+
+            // bit k of the mask holds key k down for the whole branch
+            for(int k = 0; k < 16; k++) {
+                chip8->key[k] = (job->keys[b] >> k) & 1;
+            }
+
+            job->run(chip8, job->frames);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Evaluate count possible futures of root in parallel.
+ * Branch b is forked from root, runs frames frames with the keys in keys[b] held, and is left in branches[b] so its
+ * framebuffer, registers and fault can be read back. Branches run without root's Program, metrics and latency
+ * tracking. A branch that faults stops early. threads <= 0 uses every online core, the calling thread is one of the
+ * workers.
+ */
+void chip8_eval_branches(const Chip8 *root, run_fn run, const unsigned short *keys, Chip8 *branches, int count,
+                         long frames, int threads) {
+    EvalJob job = { root, run, keys, branches, count, frames, 0 };
+
+    if(threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(threads > (count + FORK_CHUNK - 1) / FORK_CHUNK) {
+        threads = (count + FORK_CHUNK - 1) / FORK_CHUNK;
+    }
+    if(threads <= 1) {
+        eval_worker(&job);
+        return;
+    }
+
+    // the calling thread works too, so only threads - 1 are started, if some fail to start the others pick up the slack
+    pthread_t workers[threads - 1];
+    int started = 0;
+    for(; started < threads - 1; started++) {
+        if(pthread_create(&workers[started], NULL, eval_worker, &job) != 0) {
+            break;
+        }
+    }
+
+    eval_worker(&job);
+
+    for(int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
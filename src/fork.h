@@ -0,0 +1,19 @@
+#ifndef FORK_H
+#define FORK_H
+
+#include "chip8.h"
+
+#define FORK_CHUNK 16               // branches a worker claims at a time
+
+/*
+ * A fork is a plain copy of the whole machine (about 6KB). The only instructions that write memory are Fx33 and
+ * Fx55, so copy-on-write pages would save little and cost an extra indirection on every fetch.
+ */
+static inline void chip8_fork(Chip8 *child, const Chip8 *parent) {
+    *child = *parent;
+}
+
+void chip8_eval_branches(const Chip8 *root, run_fn run, const unsigned short *keys, Chip8 *branches, int count,
+                         long frames, int threads);
+
+#endif
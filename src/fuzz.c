@@ -0,0 +1,297 @@
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "chip8.h"
+#include "fork.h"
+#include "sandbox.h"
+
+#define MAX_INPUTS 256              // key masks in one input
+#define MAX_CORPUS 4096             // inputs kept because they found new coverage
+#define MAX_CRASHES 256             // distinct (fault, PC) pairs recorded
+
+/*
+ * An input is a sequence of key masks, bit k holds key k down. Each mask is applied for frames_per_input frames.
+ * Inputs that reach memory no earlier input reached are kept and mutated further, inputs that make the ROM fault
+ * are written out so they can be replayed with --replay.
+ */
+typedef struct Input
+{
+    int length;
+    unsigned short keys[MAX_INPUTS];
+} Input;
+
+Chip8 root;
+Chip8 machine;
+Coverage total;
+Coverage run_coverage;
+Input corpus[MAX_CORPUS];
+int corpus_size;
+
+struct { unsigned char fault; unsigned short PC; } crashes[MAX_CRASHES];
+int crash_count;
+
+uint64_t random_state;
+long frames_per_input = 30;
+unsigned int machine_seed;
+int quirks = 0;
+
+static uint64_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+// mostly no key or a single key, which is how games are played
+static unsigned short random_keys(void) {
+    switch(next_random() % 4) {
+        case 0:
+            return 0;
+        case 1:
+        case 2:
+            return 1 << (next_random() % 16);
+        default:
+            return next_random() & 0xFFFF;
+    }
+}
+
+static void run_input(const Input *input, emulate_fn step) {
+    chip8_fork(&machine, &root);
+    memset(&run_coverage, 0, sizeof(run_coverage));
+    machine.coverage = &run_coverage;
+
+    for(int i = 0; i < input->length && !machine.fault; i++) {
+        for(int k = 0; k < 16; k++) {
+            machine.key[k] = (input->keys[i] >> k) & 1;
+        }
+        for(long f = 0; f < frames_per_input && !machine.fault; f++) {
+            step(&machine);
+        }
+    }
+}
+
+// OR the last run into the total coverage, returns how many bits were new
+static int merge_coverage(void) {
+    unsigned char *all = (unsigned char *)&total;
+    const unsigned char *run = (const unsigned char *)&run_coverage;
+    int fresh = 0;
+
+    for(size_t i = 0; i < sizeof(Coverage); i++) {
+        unsigned char bits = run[i] & ~all[i];
+        if(bits) {
+            fresh += __builtin_popcount(bits);
+            all[i] |= bits;
+        }
+    }
+    return fresh;
+}
+
+static int count_bits(const unsigned char *bits) {
+    int count = 0;
+    for(int i = 0; i < COVERAGE_BYTES; i++) {
+        count += __builtin_popcount(bits[i]);
+    }
+    return count;
+}
+
+static void mutate(Input *input) {
+    int rounds = 1 + next_random() % 4;
+
+    for(int r = 0; r < rounds; r++) {
+        int at = next_random() % input->length;
+        switch(next_random() % 5) {
+            case 0:
+                input->keys[at] ^= 1 << (next_random() % 16);
+                break;
+            case 1:
+                input->keys[at] = random_keys();
+                break;
+            case 2:
+                if(input->length < MAX_INPUTS) {
+                    memmove(&input->keys[at + 1], &input->keys[at], sizeof(unsigned short) * (input->length - at));
+                    input->keys[at] = random_keys();
+                    input->length++;
+                }
+                break;
+            case 3:
+                if(input->length > 1) {
+                    memmove(&input->keys[at], &input->keys[at + 1], sizeof(unsigned short) * (input->length - at - 1));
+                    input->length--;
+                }
+                break;
+            default: {
+                // splice the tail of another corpus entry onto this one
+                const Input *other = &corpus[next_random() % corpus_size];
+                int from = next_random() % other->length;
+                int count = other->length - from;
+                if(at + count > MAX_INPUTS) {
+                    count = MAX_INPUTS - at;
+                }
+                memcpy(&input->keys[at], &other->keys[from], sizeof(unsigned short) * count);
+                input->length = at + count;
+                break;
+            }
+        }
+    }
+}
+
+static void save_input(const Input *input, const char *path) {
+    FILE *file = fopen(path, "w");
+    if(file == NULL) {
+        printf("Cannot write %s\n", path);
+        return;
+    }
+    fprintf(file, "# seed %u frames %ld quirks %d\n", machine_seed, frames_per_input, quirks);
+    for(int i = 0; i < input->length; i++) {
+        fprintf(file, "%04X\n", input->keys[i]);
+    }
+    fclose(file);
+}
+
+static int load_input(Input *input, const char *path) {
+    FILE *file = fopen(path, "r");
+    char line[128];
+
+    if(file == NULL) {
+        return -1;
+    }
+    input->length = 0;
+    while(fgets(line, sizeof(line), file) != NULL && input->length < MAX_INPUTS) {
+        if(line[0] == '#') {
+            sscanf(line, "# seed %u frames %ld quirks %d", &machine_seed, &frames_per_input, &quirks);
+        } else {
+            input->keys[input->length++] = (unsigned short)strtoul(line, NULL, 16);
+        }
+    }
+    fclose(file);
+    return input->length > 0 ? 0 : -1;
+}
+
+// runs end when their input does, so any fault is the ROM's own and is kept once per (fault, PC)
+static void record_fault(const Input *input, const char *out_dir) {
+    char path[512];
+
+    for(int i = 0; i < crash_count; i++) {
+        if(crashes[i].fault == machine.fault && crashes[i].PC == machine.PC) {
+            return;
+        }
+    }
+    if(crash_count == MAX_CRASHES) {
+        return;
+    }
+    crashes[crash_count].fault = machine.fault;
+    crashes[crash_count].PC = machine.PC;
+    crash_count++;
+
+    snprintf(path, sizeof(path), "%s/%s-%03X.keys", out_dir, fault_name(machine.fault), machine.PC);
+    save_input(input, path);
+    printf("fault %s at 0x%03X, input saved to %s\n", fault_name(machine.fault), machine.PC, path);
+}
+
+int main(int argc, char *argv[])
+{
+    char *rom_file = NULL;
+    char *replay_file = NULL;
+    char *out_dir = "fuzz-out";
+    long runs = 100000;
+    double seconds = 0;
+    uint64_t seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            quirks = quirks_from_name(argv[++i]);
+            if (quirks < 0) {
+                printf("Unknown quirk profile %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames_per_input = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_dir = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_file = argv[++i];
+        } else {
+            rom_file = argv[i];
+        }
+    }
+
+    if (rom_file == NULL) {
+        printf("Program Usage: ./chip8-fuzz [--quirks profile] [--runs n] [--seconds s] [--frames n] [--seed n] "
+               "[--out dir] [--replay file] path/to/rom\n");
+        exit(EXIT_FAILURE);
+    }
+
+    random_state = seed ? seed : 1;
+    machine_seed = (unsigned int)random_state | 1;
+
+    if (replay_file != NULL) {
+        // the seed, frame count and quirks stored in the file replace the ones given on the command line
+        if (load_input(&corpus[0], replay_file) != 0) {
+            printf("Cannot read %s\n", replay_file);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    initialize_chip8(&root);
+    load_rom(&root, rom_file);
+    root.quirks = quirks;
+    root.rng = machine_seed;
+    emulate_fn step = select_interpreter(root.quirks);
+
+    if (replay_file != NULL) {
+        run_input(&corpus[0], step);
+        printf("fault=%s pc=0x%03X opcode=0x%04X\n", fault_name(machine.fault), machine.PC, machine.opcode);
+        return machine.fault;
+    }
+
+    mkdir(out_dir, 0755);
+
+    // seed the corpus with doing nothing
+    corpus[0].length = 16;
+    memset(corpus[0].keys, 0, sizeof(corpus[0].keys));
+    corpus_size = 1;
+    run_input(&corpus[0], step);
+    merge_coverage();
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double elapsed = 0;
+    long run = 0;
+    Input input;
+
+    for (; runs <= 0 || run < runs; run++) {
+        input = corpus[next_random() % corpus_size];
+        mutate(&input);
+        run_input(&input, step);
+
+        if (merge_coverage() > 0 && corpus_size < MAX_CORPUS) {
+            corpus[corpus_size++] = input;
+        }
+        if (machine.fault) {
+            record_fault(&input, out_dir);
+        }
+
+        if ((run & 1023) == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+            if (seconds > 0 && elapsed >= seconds) {
+                break;
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    printf("runs=%ld runs/s=%.0f corpus=%d executed=%d read=%d written=%d faults=%d\n", run,
+           elapsed > 0 ? run / elapsed : 0, corpus_size, count_bits(total.executed), count_bits(total.read),
+           count_bits(total.written), crash_count);
+
+    return 0;
+}
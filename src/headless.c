@@ -0,0 +1,165 @@
+#include <string.h>
+#include "display.h"
+#include "sandbox.h"
+#include "trace.h"
+
+Chip8 chip8;
+Program program;
+TraceWriter trace;
+emulate_fn traced;
+
+Display display;
+run_fn undisplayed;
+uint64_t displayed_frames;
+
+// renders the display after every frame, so the phosphor blend and expansion see the same sequence as in a window
+static long displayed_run(Chip8 *chip8, long cycles) {
+    long done = 0;
+    while (done < cycles && !chip8->fault) {
+        long ran = undisplayed(chip8, 1);
+        if (ran == 0) {
+            break;
+        }
+        display_update(&display, chip8);
+        displayed_frames++;
+        done += ran;
+    }
+    return done;
+}
+
+// records every instruction the sandbox runs, one at a time so no superinstructions are used
+static long traced_run(Chip8 *chip8, long cycles) {
+    long done = 0;
+    for (; done < cycles && !chip8->fault; done++) {
+        trace_step(&trace, chip8, traced);
+    }
+    return chip8->fault && done > 0 ? done - 1 : done;
+}
+
+/*
+ * Headless runner for untrusted ROMs.
+ * Runs the ROM inside the sandbox budgets and reports why it stopped, the exit status is the Chip8Fault code.
+ */
+int main(int argc, char *argv[])
+{
+    char *rom_file = NULL;
+    int quirks = 0;
+    int quirks_given = 0;
+    int infer_quirks = 0;
+    int display_scale = 0;
+    int display_phosphor = 0;
+    char *trace_file = NULL;
+    long long seed = -1;
+    int fusion = 1;
+    int fusion_report = 0;
+    SandboxLimits limits = { 10000000, 0 };
+    SandboxResult result;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            quirks = quirks_from_name(argv[++i]);
+            if (quirks < 0) {
+                printf("Unknown quirk profile %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            quirks_given = 1;
+        } else if (strcmp(argv[i], "--display-hash") == 0 && i + 1 < argc) {
+            // scale[,phosphor]
+            if (sscanf(argv[++i], "%d,%d", &display_scale, &display_phosphor) < 1 || display_scale < 1) {
+                printf("Bad display %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--infer-quirks") == 0) {
+            infer_quirks = 1;
+        } else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc) {
+            limits.max_instructions = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--max-seconds") == 0 && i + 1 < argc) {
+            limits.max_seconds = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoll(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--no-fusion") == 0) {
+            fusion = 0;
+        } else if (strcmp(argv[i], "--fusion-report") == 0) {
+            fusion_report = 1;
+        } else {
+            rom_file = argv[i];
+        }
+    }
+
+    if (rom_file == NULL) {
+        printf("Program Usage: ./chip8-run [--quirks profile] [--max-instructions n] [--max-seconds s] [--seed n] [--trace file] [--no-fusion] [--fusion-report] [--infer-quirks] [--display-hash scale[,phosphor]] path/to/rom\n");
+        exit(EXIT_FAILURE);
+    }
+
+    initialize_chip8(&chip8);
+    load_rom(&chip8, rom_file);
+    if (seed >= 0) {
+        chip8.rng = (unsigned int)seed | 1;
+    }
+
+    ProgramAnalysis analysis;
+    if (fusion || infer_quirks) {
+        program_build(&program, &chip8);
+        if (infer_quirks) {
+            program_analyse(&program, &analysis);
+        }
+    }
+    if (infer_quirks) {
+        printf("inferred quirks=0x%02X%s%s\n", analysis.quirks,
+               analysis.computed_jumps ? " computed jumps" : "", quirks_given ? ", --quirks used instead" : "");
+        if (!quirks_given) {
+            quirks = analysis.quirks;
+        }
+    }
+    chip8.quirks = quirks;
+
+    if (fusion) {
+        chip8.program = &program;
+    }
+
+    run_fn run = select_runner(chip8.quirks);
+    if (trace_file != NULL) {
+        if (trace_open(&trace, trace_file, &chip8) != 0) {
+            printf("Cannot write %s\n", trace_file);
+            exit(EXIT_FAILURE);
+        }
+        traced = select_interpreter(chip8.quirks);
+        run = traced_run;
+    }
+
+    if (display_scale > 0) {
+        if (display_init(&display, display_scale, display_phosphor) != 0) {
+            printf("Memory not allocated\n");
+            exit(EXIT_FAILURE);
+        }
+        undisplayed = run;
+        run = displayed_run;
+    }
+
+    sandbox_run(&chip8, run, &limits, &result);
+
+    if (trace_file != NULL && trace_close(&trace) != 0) {
+        printf("Error writing %s\n", trace_file);
+    }
+
+    printf("fault=%s instructions=%llu seconds=%.6f pc=0x%03X opcode=0x%04X\n",
+           fault_name(result.fault), result.instructions, result.seconds, result.PC, result.opcode);
+
+    if (display_scale > 0) {
+        printf("display=%dx%d phosphor=%d frames=%llu hash=%016llx\n", display.width, display.height,
+               display.decay == 255 ? 0 : display.decay, (unsigned long long)displayed_frames,
+               (unsigned long long)display_hash(&display));
+        display_free(&display);
+    }
+
+    if (fusion && fusion_report) {
+        for (int kind = FUSE_NONE + 1; kind < FUSE_COUNT; kind++) {
+            printf("%-16s sites=%-4u fired=%llu\n", fuse_name(kind), program.found[kind],
+                   (unsigned long long)program.fired[kind]);
+        }
+    }
+
+    return result.fault;
+}
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "chip8.h"
+#include "fork.h"
+#include "metrics.h"
+#include "sandbox.h"
+#include "timer_wheel.h"
+
+#define FRAME_RATE 60
+#define TICK_NS 1000000ULL          // timer wheel resolution
+#define MAX_ROMS 64
+#define MAX_WORKERS 256
+#define START_LATENCY_BUCKETS 40    // log2 histogram of frame start latency in ns
+#define REPORT_MISSES 20            // sessions listed in the report, most missed deadlines first
+
+/*
+ * A session is one machine running in real time. Frame k is released at start + k * period and has to be done
+ * by the release of frame k + 1, otherwise it counts as a deadline miss. A session that falls more than a whole
+ * frame behind drops the frames it cannot make up, rather than running a burst of them late.
+ */
+typedef struct Session
+{
+    TimerEntry timer;               // first, a due TimerEntry is its Session
+    run_fn run;
+    int id;
+    uint64_t release;               // ns, release time of the next frame
+    uint64_t frames;
+    uint64_t misses;
+    uint64_t dropped;
+    uint64_t max_latency;           // ns between a frame's release and its start
+    Chip8 chip8;
+} Session;
+
+// the lines a frame is sure to touch outside the ROM: the bookkeeping above, the registers and the machine's tail
+static inline void prefetch_session(const Session *session) {
+    __builtin_prefetch(session, 1);
+    __builtin_prefetch(&session->chip8.V, 1);
+    __builtin_prefetch(&session->chip8.fault, 1);
+}
+
+/*
+ * Each worker is pinned to a core and owns its sessions and timer wheel outright, so scheduling takes no locks.
+ * Sessions due on the same tick come out of the wheel as one batch and run back to back.
+ */
+typedef struct Worker
+{
+    pthread_t thread;
+    int index;
+    int cpu;
+    Session *sessions;
+    int count;
+    TimerWheel wheel;
+    uint64_t latency[START_LATENCY_BUCKETS];
+    uint64_t batches;
+    uint64_t largest_batch;
+    Metrics metrics;
+} Worker;
+
+Chip8 roms[MAX_ROMS];
+int rom_count;
+Worker workers[MAX_WORKERS];
+int worker_count;
+long cycles_per_frame = 1;
+uint64_t period = 1000000000ULL / FRAME_RATE;
+uint64_t start_time;
+int session_count;
+int workers_ready;
+volatile int stopping;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+    struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void on_signal(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+static int latency_bucket(uint64_t ns) {
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    return bucket < START_LATENCY_BUCKETS ? bucket : START_LATENCY_BUCKETS - 1;
+}
+
+// run the due frame of a session and put its next release back into the wheel, returns the time it finished
+static uint64_t run_frame(Worker *worker, Session *session, uint64_t started) {
+    uint64_t latency = started > session->release ? started - session->release : 0;
+
+    worker->latency[latency_bucket(latency)]++;
+    if(latency > session->max_latency) {
+        session->max_latency = latency;
+    }
+
+    long ran = session->run(&session->chip8, cycles_per_frame);
+    session->frames++;
+    uint64_t finished = now_ns();
+    metrics_add(&worker->metrics.instructions, ran);
+    metrics_frame(&worker->metrics, finished - started);
+
+    session->release += period;
+    if(finished > session->release) {
+        session->misses++;
+    }
+    if(finished > session->release + period) {
+        uint64_t behind = (finished - session->release) / period;
+        session->dropped += behind;
+        session->release += behind * period;
+    }
+
+    if(session->chip8.fault) {
+        metrics_add(&worker->metrics.faults, 1);
+    } else {
+        // rounded up, a tick fires once its start has passed, so a frame never starts before its release
+        session->timer.expires = (session->release + TICK_NS - 1) / TICK_NS;
+        wheel_add(&worker->wheel, &session->timer);
+    }
+    return finished;
+}
+
+static void *worker_thread(void *arg) {
+    Worker *worker = (Worker *)arg;
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    char name[32];
+    snprintf(name, sizeof(name), "worker%d", worker->index);
+    metrics_register(&worker->metrics, name);
+
+    // the sessions are set up by the worker that runs them, so their memory is first touched on its node
+    for(int i = 0; i < worker->count; i++) {
+        Session *session = &worker->sessions[i];
+        session->id = worker->index + i * worker_count;
+        // no Program, superinstruction tables are per ROM image and each session's memory drifts apart
+        chip8_fork(&session->chip8, &roms[session->id % rom_count]);
+        session->chip8.rng = (session->chip8.rng ^ (session->id * 2654435761u)) | 1;
+        session->run = select_runner(session->chip8.quirks);
+        session->chip8.metrics = &worker->metrics;
+    }
+
+    // the clock starts once every worker is set up, so the page faults of setting up are not counted as misses
+    __atomic_add_fetch(&workers_ready, 1, __ATOMIC_RELEASE);
+    while(!__atomic_load_n(&start_time, __ATOMIC_ACQUIRE) && !stopping) {
+        sleep_until(now_ns() + TICK_NS);
+    }
+
+    wheel_init(&worker->wheel, start_time / TICK_NS);
+    for(int i = 0; i < worker->count; i++) {
+        Session *session = &worker->sessions[i];
+        // releases are spread over the period, so every tick has a similar share of the sessions to run
+        session->release = start_time + period + period * session->id / session_count;
+        session->timer.expires = (session->release + TICK_NS - 1) / TICK_NS;
+        wheel_add(&worker->wheel, &session->timer);
+    }
+
+    while(!stopping) {
+        uint64_t now = now_ns();
+        uint64_t tick = now / TICK_NS;
+        // an overloaded worker catches up to the tick it woke on and then checks for stopping again
+        while(worker->wheel.now < tick && !stopping) {
+            uint64_t batch = 0;
+            for(TimerEntry *due = wheel_advance(&worker->wheel); due != NULL; batch++) {
+                // the next pointer is reused once the session is back in the wheel
+                TimerEntry *next = due->next;
+                if(next != NULL) {
+                    prefetch_session((const Session *)next);
+                }
+                now = run_frame(worker, (Session *)due, now);
+                due = next;
+            }
+            if(batch > 0) {
+                worker->batches++;
+                if(batch > worker->largest_batch) {
+                    worker->largest_batch = batch;
+                }
+            }
+        }
+        sleep_until((worker->wheel.now + 1) * TICK_NS);
+    }
+    return NULL;
+}
+
+static double percentile(const uint64_t *histogram, double fraction) {
+    uint64_t total = 0, seen = 0;
+    for(int i = 0; i < START_LATENCY_BUCKETS; i++) {
+        total += histogram[i];
+    }
+    for(int i = 0; i < START_LATENCY_BUCKETS; i++) {
+        seen += histogram[i];
+        if(total > 0 && seen >= fraction * total) {
+            // upper bound of the bucket
+            return i == 0 ? 0 : (double)((1ULL << i) - 1) / 1e6;
+        }
+    }
+    return 0;
+}
+
+static int by_misses(const void *a, const void *b) {
+    const Session *sa = *(const Session * const *)a;
+    const Session *sb = *(const Session * const *)b;
+    if(sa->misses != sb->misses) {
+        return sa->misses < sb->misses ? 1 : -1;
+    }
+    return sa->id - sb->id;
+}
+
+static void report(double seconds) {
+    uint64_t latency[START_LATENCY_BUCKETS] = { 0 };
+    uint64_t frames = 0, misses = 0, dropped = 0, batches = 0, largest_batch = 0, max_latency = 0;
+    int faulted = 0, missing = 0;
+    Session **sessions = (Session **)malloc(sizeof(Session *) * session_count);
+
+    for(int w = 0; w < worker_count; w++) {
+        Worker *worker = &workers[w];
+        for(int i = 0; i < START_LATENCY_BUCKETS; i++) {
+            latency[i] += worker->latency[i];
+        }
+        batches += worker->batches;
+        if(worker->largest_batch > largest_batch) {
+            largest_batch = worker->largest_batch;
+        }
+        for(int i = 0; i < worker->count; i++) {
+            Session *session = &worker->sessions[i];
+            frames += session->frames;
+            misses += session->misses;
+            dropped += session->dropped;
+            faulted += session->chip8.fault != FAULT_NONE;
+            if(session->max_latency > max_latency) {
+                max_latency = session->max_latency;
+            }
+            if(session->misses > 0 || session->chip8.fault) {
+                sessions[missing++] = session;
+            }
+        }
+    }
+
+    qsort(sessions, missing, sizeof(Session *), by_misses);
+    for(int i = 0; i < missing && i < REPORT_MISSES; i++) {
+        Session *session = sessions[i];
+        printf("session=%d frames=%llu misses=%llu dropped=%llu max_latency_ms=%.3f fault=%s\n", session->id,
+               (unsigned long long)session->frames, (unsigned long long)session->misses,
+               (unsigned long long)session->dropped, session->max_latency / 1e6, fault_name(session->chip8.fault));
+    }
+    if(missing > REPORT_MISSES) {
+        printf("... %d more sessions missed deadlines or faulted\n", missing - REPORT_MISSES);
+    }
+    free(sessions);
+
+    printf("sessions=%d workers=%d seconds=%.1f frames=%llu frames/s=%.0f misses=%llu dropped=%llu faulted=%d\n",
+           session_count, worker_count, seconds, (unsigned long long)frames, frames / seconds,
+           (unsigned long long)misses, (unsigned long long)dropped, faulted);
+    printf("latency_ms p50<=%.3f p99<=%.3f p999<=%.3f max=%.3f batches=%llu largest_batch=%llu\n",
+           percentile(latency, 0.5), percentile(latency, 0.99), percentile(latency, 0.999), max_latency / 1e6,
+           (unsigned long long)batches, (unsigned long long)largest_batch);
+}
+
+int main(int argc, char *argv[])
+{
+    char *rom_files[MAX_ROMS];
+    int sessions = 1000;
+    int quirks = 0;
+    double seconds = 10;
+    unsigned int seed = 1;
+    char *metrics_file = NULL;
+    double metrics_interval = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+            sessions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            cycles_per_frame = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = (unsigned int)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_file = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+            metrics_interval = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            quirks = quirks_from_name(argv[++i]);
+            if (quirks < 0) {
+                printf("Unknown quirk profile %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (rom_count < MAX_ROMS) {
+            rom_files[rom_count++] = argv[i];
+        }
+    }
+
+    if (rom_count == 0 || sessions <= 0 || cycles_per_frame <= 0) {
+        printf("Program Usage: ./chip8-host [--sessions n] [--workers n] [--cycles n] [--seconds s] [--seed n] "
+               "[--quirks profile] [--metrics file] [--metrics-interval s] path/to/rom...\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // sessions are forked from one loaded machine per ROM, they take turns over the ROMs given
+    for (int r = 0; r < rom_count; r++) {
+        initialize_chip8(&roms[r]);
+        load_rom(&roms[r], rom_files[r]);
+        roms[r].quirks = quirks;
+        roms[r].rng = seed | 1;
+    }
+
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (worker_count <= 0) {
+        worker_count = cpus;
+    }
+    if (worker_count > MAX_WORKERS) {
+        worker_count = MAX_WORKERS;
+    }
+    if (worker_count > sessions) {
+        worker_count = sessions;
+    }
+    session_count = sessions;
+
+    Session *all = (Session *)calloc(sessions, sizeof(Session));
+    if (all == NULL) {
+        printf("Memory not allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    // session ids are dealt out in turn, so each worker gets releases spread over the whole period
+    int next = 0;
+    for (int w = 0; w < worker_count; w++) {
+        workers[w].index = w;
+        workers[w].cpu = w % cpus;
+        workers[w].sessions = all + next;
+        workers[w].count = sessions / worker_count + (w < sessions % worker_count);
+        next += workers[w].count;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    int started = 0;
+    for (; started < worker_count; started++) {
+        if (pthread_create(&workers[started].thread, NULL, worker_thread, &workers[started]) != 0) {
+            break;
+        }
+    }
+    if (started < worker_count) {
+        printf("Started %d of %d workers\n", started, worker_count);
+        stopping = 1;
+    }
+    while (!stopping && __atomic_load_n(&workers_ready, __ATOMIC_ACQUIRE) < started) {
+        sleep_until(now_ns() + TICK_NS);
+    }
+    __atomic_store_n(&start_time, now_ns(), __ATOMIC_RELEASE);
+    if (metrics_file != NULL && metrics_start_export(metrics_file, metrics_interval) != 0) {
+        printf("Cannot export metrics to %s\n", metrics_file);
+    }
+
+    uint64_t end = start_time + (uint64_t)(seconds * 1e9);
+    while (!stopping && now_ns() < end) {
+        sleep_until(now_ns() + 100 * TICK_NS < end ? now_ns() + 100 * TICK_NS : end);
+    }
+    stopping = 1;
+    for (int w = 0; w < started; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    metrics_stop_export();
+
+    report((now_ns() - start_time) / 1e9);
+    free(all);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#include "input.h"
+
+// The mapping for the chip8 hex keypad to keyboard is in keymap.h
+void handle_input(Chip8 *chip8) {
+    for(int i = 0; i < 16; i++) {
+        if(IsKeyDown(chip8_keymap[i])) {
+#ifdef CHIP8_DEBUG
+            printf("%c key pressed\n", chip8_keymap[i]);
+#endif
+            chip8->key[i] = 1;
+        } else {
+            chip8->key[i] = 0;
+        }
+    }
+}
+
+// presses are timestamped when the host reports them, releases of keys the ROM never read drop the measurement
+void handle_latency_input(Latency *latency, double now) {
+    for(int i = 0; i < 16; i++) {
+        if(IsKeyPressed(chip8_keymap[i])) {
+            latency_key_down(latency, i, now);
+        } else if(IsKeyReleased(chip8_keymap[i])) {
+            latency_key_up(latency, i);
+        }
+    }
+}
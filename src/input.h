@@ -0,0 +1,13 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdio.h>
+#include "raylib.h"
+#include "chip8_context.h"
+#include "keymap.h"
+#include "latency.h"
+
+void handle_input(Chip8 *chip8);
+void handle_latency_input(Latency *latency, double now);
+
+#endif
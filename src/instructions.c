@@ -1,5 +1,7 @@
 #include "instructions.h"
 
+#include <string.h>
+
 /*
     nnn or addr - A 12-bit value, the lowest 12 bits of the instruction
     n or nibble - A 4-bit value, the lowest 4 bits of the instruction
@@ -13,6 +15,9 @@
  * Clear the display.
  */
 void cls(Chip8 *chip8) {
+    if(chip8->latency && memchr(chip8->gfx, 1, sizeof(chip8->gfx)) != NULL) {
+        latency_display_changed(chip8->latency);
+    }
     for(int i = 0; i < 64; i++) {
         for(int j = 0; j < 32; j++) {
             chip8->gfx[i][j] = 0;
@@ -25,8 +30,13 @@ void cls(Chip8 *chip8) {
  * 00EE - RET
  * Return from a subroutine.
  * The interpreter sets the program counter to the address at the top of the stack, then subtracts 1 from the stack pointer.
+ * Returning with an empty stack faults instead.
  */
 void ret(Chip8 *chip8) {
+    if(chip8->SP == 0) {
+        chip8->fault = FAULT_STACK_UNDERFLOW;
+        return;
+    }
     chip8->PC = chip8->stack[chip8->SP];
     chip8->SP--;
     chip8->PC += 2;
@@ -39,6 +49,12 @@ void ret(Chip8 *chip8) {
  */
 void jmp(Chip8 *chip8) {
     unsigned short nnn = chip8->opcode & 0x0FFF;
+
+    // back to an Fx07, 3xkk right before it: a delay timer polling loop, counted the same as FUSE_TIMER_POLL counts it
+    if(chip8->metrics && nnn == chip8->PC - 4 && (chip8->memory[nnn] & 0xF0) == 0xF0 &&
+       chip8->memory[(nnn + 1) & ADDR_MASK] == 0x07 && (chip8->memory[(nnn + 2) & ADDR_MASK] & 0xF0) == 0x30) {
+        metrics_add(&chip8->metrics->idle, 3);
+    }
     chip8->PC = nnn;
 }
 
@@ -46,9 +62,14 @@ void jmp(Chip8 *chip8) {
  * 2nnn - CALL addr
  * Call subroutine at nnn.
  * The interpreter increments the stack pointer, then puts the current PC on the top of the stack. The PC is then set to nnn.
+ * Calling with a full stack faults instead.
  */
 void call(Chip8 *chip8) {
     unsigned short nnn = chip8->opcode & 0x0FFF;
+    if(chip8->SP >= STACK_DEPTH) {
+        chip8->fault = FAULT_STACK_OVERFLOW;
+        return;
+    }
     chip8->SP++;
     chip8->stack[chip8->SP] = chip8->PC;
     chip8->PC = nnn;
@@ -149,6 +170,18 @@ void or_Vx_Vy(Chip8 *chip8) {
     chip8->PC += 2;
 }
 
+/*
+ * 8xy1 - OR Vx, Vy (VF reset quirk)
+ * As or_Vx_Vy, and VF is then set to 0 like on the original COSMAC VIP interpreter.
+ */
+void or_Vx_Vy_vf_reset(Chip8 *chip8) {
+    unsigned char x = (chip8->opcode & 0x0F00) >> 8;
+    unsigned char y = (chip8->opcode & 0x00F0) >> 4;
+    chip8->V[x] |= chip8->V[y];
+    chip8->V[0xF] = 0;
+    chip8->PC += 2;
+}
+
 /*
  * 8xy2 - AND Vx, Vy
  * Set Vx = Vx AND Vy.
@@ -163,6 +196,18 @@ void and_Vx_Vy(Chip8 *chip8) {
     chip8->PC += 2;
 }
 
+/*
+ * 8xy2 - AND Vx, Vy (VF reset quirk)
+ * As and_Vx_Vy, and VF is then set to 0 like on the original COSMAC VIP interpreter.
+ */
+void and_Vx_Vy_vf_reset(Chip8 *chip8) {
+    unsigned char x = (chip8->opcode & 0x0F00) >> 8;
+    unsigned char y = (chip8->opcode & 0x00F0) >> 4;
+    chip8->V[x] &= chip8->V[y];
+    chip8->V[0xF] = 0;
+    chip8->PC += 2;
+}
+
 /*
  * 8xy3 - XOR Vx, Vy
  * Set Vx = Vx XOR Vy.
@@ -177,6 +222,18 @@ void xor_Vx_Vy(Chip8 *chip8) {
     chip8->PC += 2;
 }
 
+/*
+ * 8xy3 - XOR Vx, Vy (VF reset quirk)
+ * As xor_Vx_Vy, and VF is then set to 0 like on the original COSMAC VIP interpreter.
+ */
+void xor_Vx_Vy_vf_reset(Chip8 *chip8) {
+    unsigned char x = (chip8->opcode & 0x0F00) >> 8;
+    unsigned char y = (chip8->opcode & 0x00F0) >> 4;
+    chip8->V[x] ^= chip8->V[y];
+    chip8->V[0xF] = 0;
+    chip8->PC += 2;
+}
+
 /*
  * 8xy4 - ADD Vx, Vy
  * Set Vx = Vx + Vy, set VF = carry.
@@ -225,6 +282,20 @@ void shr(Chip8 *chip8) {
     chip8->PC += 2;
 }
 
+/*
+ * 8xy6 - SHR Vx, Vy (shift quirk)
+ * Set Vx = Vy SHR 1.
+ * If the least-significant bit of Vy is 1, then VF is set to 1, otherwise 0. Then Vy divided by 2 is stored in Vx.
+ */
+void shr_Vy(Chip8 *chip8) {
+    unsigned char x = (chip8->opcode & 0x0F00) >> 8;
+    unsigned char y = (chip8->opcode & 0x00F0) >> 4;
+    unsigned char flag = chip8->V[y] & 0x01;
+    chip8->V[x] = chip8->V[y] >> 1;
+    chip8->V[0xF] = flag;
+    chip8->PC += 2;
+}
+
 /*
  * 8xy7 - SUBN Vx, Vy
  * Set Vx = Vy - Vx, set VF = NOT borrow.
@@ -254,6 +325,20 @@ void shl(Chip8 *chip8) {
     chip8->PC += 2;
 }
 
+/*
+ * 8xyE - SHL Vx, Vy (shift quirk)
+ * Set Vx = Vy SHL 1.
+ * If the most-significant bit of Vy is 1, then VF is set to 1, otherwise to 0. Then Vy multiplied by 2 is stored in Vx.
+ */
+void shl_Vy(Chip8 *chip8) {
+    unsigned char x = (chip8->opcode & 0x0F00) >> 8;
+    unsigned char y = (chip8->opcode & 0x00F0) >> 4;
+    unsigned char flag = chip8->V[y] >> 7;
+    chip8->V[x] = chip8->V[y] << 1;
+    chip8->V[0xF] = flag;
+    chip8->PC += 2;
+}
+
 /*
  * 9xy0 - SNE Vx, Vy
  * Skip next instruction if Vx != Vy.
@@ -290,6 +375,17 @@ void jmp_V0(Chip8 *chip8) {
     chip8->PC = nnn + chip8->V[0x0];
 }
 
+/*
+ * Bxnn - JP Vx, addr (jump quirk)
+ * Jump to location xnn + Vx.
+ * CHIP-48 and SUPER-CHIP read the register from the high nibble of the address instead of always using V0.
+ */
+void jmp_Vx(Chip8 *chip8) {
+    unsigned short nnn = chip8->opcode & 0x0FFF;
+    unsigned char x = (chip8->opcode & 0x0F00) >> 8;
+    chip8->PC = nnn + chip8->V[x];
+}
+
 /*
  * Cxkk - RND Vx, byte
  * Set Vx = random byte AND kk.
@@ -299,8 +395,11 @@ void jmp_V0(Chip8 *chip8) {
 void rnd(Chip8 *chip8) {
     unsigned char x = (chip8->opcode & 0x0F00) >> 8;
     unsigned char kk = chip8->opcode & 0x00FF;
-    srand(time(NULL));                        // Initialization, should only be called once.
-    unsigned char r = rand() % 256;           // Returns a pseudo-random integer between 0 and RAND_MAX.
+    // xorshift32 on per machine state, seeded once in initialize_chip8, so forked machines replay the same numbers
+    chip8->rng ^= chip8->rng << 13;
+    chip8->rng ^= chip8->rng >> 17;
+    chip8->rng ^= chip8->rng << 5;
+    unsigned char r = chip8->rng >> 24;
     chip8->V[x] = r & kk;
     chip8->PC += 2;
 }
@@ -311,19 +410,24 @@ void rnd(Chip8 *chip8) {
  * The interpreter reads n bytes from memory, starting at the address stored in I. These bytes are then displayed as
  * sprites on screen at coordinates (Vx, Vy). Sprites are XORed onto the existing screen. If this causes any pixels to
  * be erased, VF is set to 1, otherwise it is set to 0. If the sprite is positioned so part of it is outside the
- * coordinates of the display, it wraps around to the opposite side of the screen.
+ * coordinates of the display, that part is clipped (see drw_wrap for the wrapping behaviour).
  */
-void drw(Chip8 *chip8) {
+static inline void draw_sprite(Chip8 *chip8, const int wrap) {
     unsigned char regX = (chip8->opcode & 0x0F00) >> 8;
     unsigned char regY = (chip8->opcode & 0x00F0) >> 4;
     int n = (chip8->opcode & 0x000F);
     int width = 8;
+    int changed = 0;
 
     chip8->V[0xF] = 0;
 
+    if (chip8->coverage) {
+        coverage_mark_range(chip8->coverage->read, chip8->I, n);
+    }
+
     for (int row = 0; row < n; row++) {
         // Get a row one of sprite data from the memory address in reg I (one byte per row)
-        unsigned char spriteData = (chip8->memory[chip8->I + row]);
+        unsigned char spriteData = (chip8->memory[(chip8->I + row) & ADDR_MASK]);
 
         // for each 8 pixels/bits in this sprite row
         for (int col = 0; col < width; col++) {
@@ -332,20 +436,44 @@ void drw(Chip8 *chip8) {
             if ((spriteData & 0x80) > 0) {
                 int x = chip8->V[regX] + col;
                 int y = chip8->V[regY] + row;
+                if (wrap) {
+                    x %= 64;
+                    y %= 32;
+                }
                 if ((x >= 0 && x < 64) && (y >= 0 && y < 32)) {
                     if (chip8->gfx[x][y] == 1) {
                         chip8->V[0xF] = 1;
                     }
                     chip8->gfx[x][y] ^= 1;
+                    changed = 1;
                 }
             }
             // Point spriteData to the next bit
             spriteData <<= 1;
         }
     }
+    if (changed && chip8->latency) {
+        latency_display_changed(chip8->latency);
+    }
+    if (chip8->metrics) {
+        metrics_add(&chip8->metrics->draws, 1);
+        metrics_add(&chip8->metrics->collisions, chip8->V[0xF]);
+    }
     chip8->PC += 2;
 }
 
+void drw(Chip8 *chip8) {
+    draw_sprite(chip8, 0);
+}
+
+/*
+ * Dxyn - DRW Vx, Vy, nibble (wrap quirk)
+ * As drw, but pixels that fall outside the display wrap around to the opposite side instead of being clipped.
+ */
+void drw_wrap(Chip8 *chip8) {
+    draw_sprite(chip8, 1);
+}
+
 /*
  * Ex9E - SKP Vx
  * Skip next instruction if key with the value of Vx is pressed.
@@ -353,7 +481,10 @@ void drw(Chip8 *chip8) {
  */
 void skp(Chip8 *chip8) {
     unsigned char x = (chip8->opcode & 0x0F00) >> 8;
-    if(chip8->key[chip8->V[x]] != 0) {
+    if(chip8->latency) {
+        latency_key_read(chip8->latency, chip8->V[x] & 0xF);
+    }
+    if(chip8->key[chip8->V[x] & 0xF] != 0) {
         chip8->PC += 4;
     } else {
         chip8->PC += 2;
@@ -367,7 +498,10 @@ void skp(Chip8 *chip8) {
  */
 void sknp(Chip8 *chip8) {
     unsigned char x = (chip8->opcode & 0x0F00) >> 8;
-    if(chip8->key[chip8->V[x]] == 0) {
+    if(chip8->latency) {
+        latency_key_read(chip8->latency, chip8->V[x] & 0xF);
+    }
+    if(chip8->key[chip8->V[x] & 0xF] == 0) {
         chip8->PC += 4;
     } else {
         chip8->PC += 2;
@@ -392,8 +526,10 @@ void ld_Vx_dt(Chip8 *chip8) {
  */
 void ld_Vx_key(Chip8 *chip8) {
     unsigned char x = (chip8->opcode & 0x0F00) >> 8;
-    unsigned char p;
-    
+    unsigned char p = 0;
+
+    // every Fx0A waits for a key of its own, a key seen by an earlier one does not count
+    chip8->is_key_pressed = 0;
     for(int i = 0; i < 16; i++) {
         if(chip8->key[i] == 1) {
             chip8->is_key_pressed = 1;
@@ -403,8 +539,14 @@ void ld_Vx_key(Chip8 *chip8) {
 
     if(!chip8->is_key_pressed) {
         chip8->PC -= 2;
+        if(chip8->metrics) {
+            metrics_add(&chip8->metrics->idle, 1);
+        }
     } else {
         chip8->V[x] = p;
+        if(chip8->latency) {
+            latency_key_read(chip8->latency, p & 0xF);
+        }
     }
 
     chip8->PC += 2;
@@ -462,9 +604,15 @@ void ld_F_Vx(Chip8 *chip8) {
  */
 void ld_bcd_Vx(Chip8 *chip8) {
     unsigned char x = (chip8->opcode & 0x0F00) >> 8;
-    chip8->memory[chip8->I] = chip8->V[x] / 100;
-    chip8->memory[chip8->I + 1] = (chip8->V[x] / 10) % 10;
-    chip8->memory[chip8->I + 2] = (chip8->V[x] % 100) % 10;
+    if(chip8->coverage) {
+        coverage_mark_range(chip8->coverage->written, chip8->I, 3);
+    }
+    chip8->memory[chip8->I & ADDR_MASK] = chip8->V[x] / 100;
+    chip8->memory[(chip8->I + 1) & ADDR_MASK] = (chip8->V[x] / 10) % 10;
+    chip8->memory[(chip8->I + 2) & ADDR_MASK] = (chip8->V[x] % 100) % 10;
+    if(chip8->program) {
+        program_invalidate(chip8->program, chip8->memory, chip8->I, 3);
+    }
     chip8->PC += 2;
 }
 
@@ -475,8 +623,14 @@ void ld_bcd_Vx(Chip8 *chip8) {
  */
 void ld_regs_Vx(Chip8 *chip8) {
     unsigned char x = (chip8->opcode & 0x0F00) >> 8;
+    if(chip8->coverage) {
+        coverage_mark_range(chip8->coverage->written, chip8->I, x + 1);
+    }
     for(unsigned char i = 0; i <= x; i++) {
-        chip8->memory[chip8->I + i] = chip8->V[i]; 
+        chip8->memory[(chip8->I + i) & ADDR_MASK] = chip8->V[i]; 
+    }
+    if(chip8->program) {
+        program_invalidate(chip8->program, chip8->memory, chip8->I, x + 1);
     }
     chip8->PC += 2;
 }
@@ -488,8 +642,31 @@ void ld_regs_Vx(Chip8 *chip8) {
  */
 void ld_Vx_regs(Chip8 *chip8) {
     unsigned char x = (chip8->opcode & 0x0F00) >> 8;
+    if(chip8->coverage) {
+        coverage_mark_range(chip8->coverage->read, chip8->I, x + 1);
+    }
     for(unsigned char i = 0; i <= x; i++) {
-        chip8->V[i] = chip8->memory[chip8->I + i]; 
+        chip8->V[i] = chip8->memory[(chip8->I + i) & ADDR_MASK]; 
     }
     chip8->PC += 2;
-}
\ No newline at end of file
+}
+
+/*
+ * Fx55 - LD [I], Vx (load/store quirk)
+ * As ld_regs_Vx, and I is left pointing past the last byte written (I = I + x + 1) like on the COSMAC VIP.
+ */
+void ld_regs_Vx_inc(Chip8 *chip8) {
+    unsigned char x = (chip8->opcode & 0x0F00) >> 8;
+    ld_regs_Vx(chip8);
+    chip8->I += x + 1;
+}
+
+/*
+ * Fx65 - LD Vx, [I] (load/store quirk)
+ * As ld_Vx_regs, and I is left pointing past the last byte read (I = I + x + 1) like on the COSMAC VIP.
+ */
+void ld_Vx_regs_inc(Chip8 *chip8) {
+    unsigned char x = (chip8->opcode & 0x0F00) >> 8;
+    ld_Vx_regs(chip8);
+    chip8->I += x + 1;
+}
@@ -2,6 +2,10 @@
 #define INSTRUCTIONS_H
 
 #include "chip8_context.h"
+#include "coverage.h"
+#include "program.h"
+#include "latency.h"
+#include "metrics.h"
 #include <time.h>
 #include <stdlib.h>
 
@@ -48,4 +52,15 @@ void ld_bcd_Vx(Chip8 *chip8);       // (Fx33) store BCD representation of Vx in
 void ld_regs_Vx(Chip8 *chip8);      // (Fx55) store registers V0 through Vx in memory starting at location I
 void ld_Vx_regs(Chip8 *chip8);      // (Fx65) read registers V0 through Vx from memory starting at location I
 
+// quirk variants, selected per ROM through the interpreter variant (see quirks.h)
+void or_Vx_Vy_vf_reset(Chip8 *chip8);   // (8xy1) set Vx = Vx OR Vy, set VF = 0
+void and_Vx_Vy_vf_reset(Chip8 *chip8);  // (8xy2) set Vx = Vx AND Vy, set VF = 0
+void xor_Vx_Vy_vf_reset(Chip8 *chip8);  // (8xy3) set Vx = Vx XOR Vy, set VF = 0
+void shr_Vy(Chip8 *chip8);              // (8xy6) set Vx = Vy SHR 1
+void shl_Vy(Chip8 *chip8);              // (8xyE) set Vx = Vy SHL 1
+void jmp_Vx(Chip8 *chip8);              // (Bxnn) jump to location xnn + Vx
+void drw_wrap(Chip8 *chip8);            // (Dxyn) as DRW, sprites wrap around the display edges
+void ld_regs_Vx_inc(Chip8 *chip8);      // (Fx55) as LD [I], Vx then I = I + x + 1
+void ld_Vx_regs_inc(Chip8 *chip8);      // (Fx65) as LD Vx, [I] then I = I + x + 1
+
 #endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+/*
+ *  Keypad                   Keyboard
+ * +-+-+-+-+                +-+-+-+-+
+ * |1|2|3|C|                |1|2|3|4|
+ * +-+-+-+-+                +-+-+-+-+
+ * |4|5|6|D|                |Q|W|E|R|
+ * +-+-+-+-+       =>       +-+-+-+-+
+ * |7|8|9|E|                |A|S|D|F|
+ * +-+-+-+-+                +-+-+-+-+
+ * |A|0|B|F|                |Z|X|C|V|
+ * +-+-+-+-+                +-+-+-+-+
+ *
+ * chip8_keymap[i] is the keyboard key that sets key[i], shared by every frontend.
+ * The values are ASCII, which is also what raylib uses for the KEY_* codes of digits and letters.
+ */
+static const unsigned char chip8_keymap[16] =
+{
+    '1', '2', '3', '4',
+    'Q', 'W', 'E', 'R',
+    'A', 'S', 'D', 'F',
+    'Z', 'X', 'C', 'V'
+};
+
+#endif
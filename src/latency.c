@@ -0,0 +1,74 @@
+#include "latency.h"
+
+#include <string.h>
+
+void latency_init(Latency *latency, FILE *log) {
+    memset(latency, 0, sizeof(*latency));
+    latency->log = log;
+    if(log != NULL) {
+        fprintf(log, "key,pressed_s,read_ms,present_ms\n");
+    }
+}
+
+// a key that is already being followed keeps its first press
+void latency_key_down(Latency *latency, int key, double now) {
+    uint16_t bit = 1 << key;
+    if(!((latency->armed | latency->read | latency->drawn) & bit)) {
+        latency->armed |= bit;
+        latency->pressed_at[key] = now;
+    }
+}
+
+// released before the ROM looked at it, so the press never had an effect to measure
+void latency_key_up(Latency *latency, int key) {
+    latency->armed &= ~(1 << key);
+}
+
+// called after each batch of emulation, stamps the keys the ROM read during it
+void latency_emulated(Latency *latency, double now) {
+    uint16_t fresh = (latency->read | latency->drawn) & ~latency->read_stamped;
+    for(int key = 0; fresh; key++, fresh >>= 1) {
+        if(fresh & 1) {
+            latency->read_at[key] = now;
+        }
+    }
+    latency->read_stamped |= latency->read | latency->drawn;
+}
+
+// called once the frame holding the display changes has been handed over for presenting
+void latency_presented(Latency *latency, double now) {
+    uint16_t drawn = latency->drawn;
+
+    for(int key = 0; drawn; key++, drawn >>= 1) {
+        if(!(drawn & 1)) {
+            continue;
+        }
+        double ms = (now - latency->pressed_at[key]) * 1000;
+        int bucket = (int)(ms / LATENCY_BUCKET_MS);
+        latency->histogram[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+        latency->samples++;
+        latency->last_ms = ms;
+        if(latency->log != NULL) {
+            fprintf(latency->log, "%X,%.6f,%.3f,%.3f\n", key, latency->pressed_at[key],
+                    (latency->read_at[key] - latency->pressed_at[key]) * 1000, ms);
+        }
+    }
+    latency->read_stamped &= ~latency->drawn;
+    latency->drawn = 0;
+}
+
+// upper edge of the bucket holding the given fraction of samples, in ms
+double latency_percentile(const Latency *latency, double fraction) {
+    uint64_t seen = 0;
+
+    if(latency->samples == 0) {
+        return 0;
+    }
+    for(int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency->histogram[i];
+        if(seen >= fraction * latency->samples) {
+            return (i + 1) * LATENCY_BUCKET_MS;
+        }
+    }
+    return LATENCY_BUCKETS * LATENCY_BUCKET_MS;
+}
@@ -0,0 +1,55 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "chip8_context.h"
+
+#define LATENCY_BUCKET_MS 0.25
+#define LATENCY_BUCKETS 8000        // up to 2s, slower samples land in the last bucket
+
+/*
+ * Input to photon latency, attached to a machine through Chip8.latency.
+ *
+ * The frontend arms a key when the host reports it pressed. The core moves an armed key to read when SKP, SKNP or
+ * LD Vx, K looks at it, and every read key to drawn when the next CLS or DRW changes the display. The frontend then
+ * records a sample for each drawn key once the frame is presented. Bit k of each mask is key k.
+ */
+typedef struct Latency
+{
+    // updated by the core
+    uint16_t armed;                 // pressed on the host, not read by the ROM yet
+    uint16_t read;                  // read by the ROM, the display has not changed since
+    uint16_t drawn;                 // the display changed after the read, not presented yet
+
+    // updated by the frontend, times in seconds on its clock
+    uint16_t read_stamped;          // read or drawn keys whose read_at is set
+    double pressed_at[16];
+    double read_at[16];
+    uint32_t histogram[LATENCY_BUCKETS];    // press to present
+    uint64_t samples;
+    double last_ms;
+    FILE *log;                      // one CSV line per sample, NULL for none
+} Latency;
+
+static inline void latency_key_read(Latency *latency, int key) {
+    uint16_t bit = 1 << key;
+    if(latency->armed & bit) {
+        latency->armed &= ~bit;
+        latency->read |= bit;
+    }
+}
+
+static inline void latency_display_changed(Latency *latency) {
+    latency->drawn |= latency->read;
+    latency->read = 0;
+}
+
+void latency_init(Latency *latency, FILE *log);
+void latency_key_down(Latency *latency, int key, double now);
+void latency_key_up(Latency *latency, int key);
+void latency_emulated(Latency *latency, double now);
+void latency_presented(Latency *latency, double now);
+double latency_percentile(const Latency *latency, double fraction);
+
+#endif
@@ -1,46 +1,277 @@
+#include <string.h>
 #include "chip8.h"
+#include "display.h"
+#include "fork.h"
+#include "input.h"
+#include "latency.h"
+#include "metrics.h"
+#include "sandbox.h"
+
+#define FRAME_RATE 60
+#define TURBO_SLICE 0.75            // share of a presented frame spent emulating in unlimited turbo mode
+#define TURBO_CHUNK 256             // frames emulated between clock reads in unlimited turbo mode
 
 Chip8 chip8;
+Chip8 ahead;
+Display display;
+
+Program program;
+Latency latency;
+Metrics metrics;
 
 int main(int argc, char *argv[])
 {
     int const WINDOW_HEIGHT = 640;
     int const WINDOW_WIDTH = 1280;
+    int const SCALE = 20;
+
+    char *rom_file = NULL;
+    int phosphor = 0;
+    int quirks = 0;
+    int turbo = 0;
+    int turbo_speed = 0;            // frames emulated per presented frame, 0 = as many as the host allows
+    int measure_latency = 0;
+    FILE *latency_log = NULL;
+    char *metrics_file = NULL;
+    double metrics_interval = 1;
+    int metrics_overlay = 0;
+    int run_ahead = 0;              // presented frames the shown machine runs ahead of the real one
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--phosphor") == 0) {
+            phosphor = DISPLAY_DEFAULT_PHOSPHOR;
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            quirks = quirks_from_name(argv[++i]);
+            if (quirks < 0) {
+                printf("Unknown quirk profile %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--turbo") == 0 && i + 1 < argc) {
+            turbo = 1;
+            i++;
+            turbo_speed = strcmp(argv[i], "max") == 0 ? 0 : atoi(argv[i]);
+            if (turbo_speed < 0) {
+                turbo_speed = 0;
+            }
+        } else if (strcmp(argv[i], "--latency") == 0) {
+            measure_latency = 1;
+        } else if (strcmp(argv[i], "--latency-log") == 0 && i + 1 < argc) {
+            measure_latency = 1;
+            latency_log = fopen(argv[++i], "w");
+            if (latency_log == NULL) {
+                printf("Cannot write %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+            run_ahead = atoi(argv[++i]);
+            if (run_ahead < 0) {
+                run_ahead = 0;
+            }
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_file = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+            metrics_interval = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--metrics-overlay") == 0) {
+            metrics_overlay = 1;
+        } else {
+            rom_file = argv[i];
+        }
+    }
+
+    if (rom_file == NULL) {
+        printf("Program Usage: ./chip8 [--phosphor] [--quirks profile] [--turbo n|max] [--run-ahead n] [--latency] [--latency-log file] [--metrics file] [--metrics-interval s] [--metrics-overlay] path/to/rom\n");
+        exit(EXIT_FAILURE);
+    }
 
-    if (argv[1] == NULL) {
-        printf("Program Usage: ./chip8 path/to/rom\n");
+    if (display_init(&display, SCALE, phosphor) != 0) {
+        printf("Memory not allocated\n");
         exit(EXIT_FAILURE);
     }
 
     InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "CHIP-8");
 
-    SetTargetFPS(60); // Set our game to run at 60 frames-per-second
+    SetTargetFPS(FRAME_RATE); // Set our game to run at 60 frames-per-second
+
+    // the display is expanded on the CPU and uploaded once per frame as a single texture
+    Image screen = GenImageColor(display.width, display.height, BLACK);
+    Texture2D screen_texture = LoadTextureFromImage(screen);
+    UnloadImage(screen);
 
     initialize_chip8(&chip8);
-    char *rom_file = argv[1];
     load_rom(&chip8, rom_file);
+    chip8.quirks = quirks;
+    program_build(&program, &chip8);
+    chip8.program = &program;
+    // every frame runs a single instruction, so frames can be run in bulk with superinstructions
+    run_fn run_frames = select_runner(chip8.quirks);
+    if (measure_latency) {
+        latency_init(&latency, latency_log);
+        // with run-ahead the keys are followed on the machine that is shown
+        chip8.latency = run_ahead ? NULL : &latency;
+    }
+    metrics_register(&metrics, "main");
+    chip8.metrics = &metrics;
+    if (metrics_file != NULL && metrics_start_export(metrics_file, metrics_interval) != 0) {
+        printf("Cannot export metrics to %s\n", metrics_file);
+    }
+    Metrics overlay_metrics = metrics;
+    double overlay_rate = 0;
+
+    // achieved speed, measured over roughly half a second
+    double speed_window_start = GetTime();
+    long speed_window_frames = 0;
+    double speed = 1.0;
+
+    // time spent on run-ahead, in total and over the last speed window
+    double ahead_copy = 0, ahead_run = 0;
+    double window_copy = 0, window_run = 0;
+    long ahead_frames = 0, window_ahead_frames = 0;
+    double overlay_copy = 0, overlay_run = 0;
 
     // Main game loop
     while (!WindowShouldClose()) // Detect window close button or ESC key
     {
+        double frame_start = GetTime();
+
+        if (IsKeyPressed(KEY_TAB)) {
+            turbo = !turbo;
+        }
+
         handle_input(&chip8);
-        emulate_cycle(&chip8);
+        if (measure_latency) {
+            handle_latency_input(&latency, frame_start);
+        }
+        unsigned char sound_timer = chip8.sound_timer;
+
+        // in turbo mode only the last of the emulated frames is presented
+        long frames_run = 0;
+        if (!turbo) {
+            frames_run = run_frames(&chip8, 1);
+        } else if (turbo_speed > 0) {
+            frames_run = run_frames(&chip8, turbo_speed);
+        } else {
+            double deadline = frame_start + TURBO_SLICE / FRAME_RATE;
+            do {
+                frames_run += run_frames(&chip8, TURBO_CHUNK);
+            } while (!chip8.fault && GetTime() < deadline);
+        }
+        speed_window_frames += frames_run;
+        metrics_add(&metrics.instructions, frames_run);
+
+        /*
+         * Run-ahead: the real machine has advanced by one frame with this frame's input, a copy of it runs the next
+         * run_ahead frames with the same input and that copy is shown. What a key press changes appears run_ahead
+         * frames sooner. The copy is thrown away, the next frame copies the real machine again.
+         */
+        Chip8 *shown = &chip8;
+        if (run_ahead > 0 && !chip8.fault) {
+            double copy_start = GetTime();
+            chip8_fork(&ahead, &chip8);
+            double run_start = GetTime();
+            // only the real machine counts in the metrics
+            ahead.metrics = NULL;
+            ahead.latency = measure_latency ? &latency : NULL;
+            // in unlimited turbo mode the real run already filled the frame, the copy only gets run_ahead frames
+            run_frames(&ahead, turbo && turbo_speed == 0 ? run_ahead : frames_run * run_ahead);
+            double run_end = GetTime();
+            if (!ahead.fault) {
+                shown = &ahead;
+            }
+            window_copy += run_start - copy_start;
+            window_run += run_end - run_start;
+            window_ahead_frames++;
+        }
+
+        if (measure_latency) {
+            latency_emulated(&latency, GetTime());
+        }
+
+        if (frame_start - speed_window_start >= 0.5) {
+            speed = speed_window_frames / ((frame_start - speed_window_start) * FRAME_RATE);
+            overlay_rate = (metrics.instructions - overlay_metrics.instructions) / (frame_start - speed_window_start);
+            overlay_metrics = metrics;
+            if (window_ahead_frames > 0) {
+                overlay_copy = window_copy / window_ahead_frames;
+                overlay_run = window_run / window_ahead_frames;
+                ahead_copy += window_copy;
+                ahead_run += window_run;
+                ahead_frames += window_ahead_frames;
+                window_copy = window_run = 0;
+                window_ahead_frames = 0;
+            }
+            speed_window_start = frame_start;
+            speed_window_frames = 0;
+        }
+
+        // the core stays quiet, the sound timer running out is reported here
+        if (sound_timer > 0 && chip8.sound_timer == 0) {
+            printf("BEEP\n");
+        }
+
+        if (chip8.fault) {
+            metrics_add(&metrics.faults, 1);
+            printf("Stopped at 0x%03X (opcode 0x%04X): %s\n", chip8.PC, chip8.opcode, fault_name(chip8.fault));
+            break;
+        }
+
+        display_update(&display, shown);
+        UpdateTexture(screen_texture, display.pixels);
 
         // Draw
         BeginDrawing();
         ClearBackground(BLACK);
+        DrawTexture(screen_texture, 0, 0, WHITE);
+        if (turbo) {
+            DrawText(TextFormat("TURBO x%.1f", speed), 10, 10, 20, GREEN);
+        }
+        if (run_ahead > 0) {
+            DrawText(TextFormat("RUN-AHEAD %d  copy %.1fus  run %.1fus", run_ahead, overlay_copy * 1e6, overlay_run * 1e6),
+                     10, 85, 20, GREEN);
+        }
+        if (measure_latency) {
+            DrawText(TextFormat("LATENCY p50 %.1fms p99 %.1fms last %.1fms n=%llu", latency_percentile(&latency, 0.5),
+                                latency_percentile(&latency, 0.99), latency.last_ms,
+                                (unsigned long long)latency.samples), 10, 35, 20, GREEN);
+        }
+        if (metrics_overlay) {
+            DrawText(TextFormat("%.0f instr/s  draws %llu  collisions %llu  idle %.0f%%  frame %.2fms",
+                                overlay_rate, (unsigned long long)metrics.draws,
+                                (unsigned long long)metrics.collisions,
+                                metrics.instructions ? 100.0 * metrics.idle / metrics.instructions : 0.0,
+                                metrics.frames ? metrics.frame_ns / 1e6 / metrics.frames : 0.0), 10, 60, 20, GREEN);
+        }
+        // the frame is handed to the swap here, raylib gives no way to see when it reaches the screen
+        double present = GetTime();
+        EndDrawing();
+        if (measure_latency) {
+            latency_presented(&latency, present);
+        }
+        // a frame runs from one frame start to the next, the wait for the target frame rate included
+        metrics_frame(&metrics, (uint64_t)((GetTime() - frame_start) * 1e9));
+    }
 
-        for (int x = 0; x < 64; x++) {
-            for (int y = 0; y < 32; y++) {
-                if (chip8.gfx[x][y]) {
-                    DrawRectangle(x * 20, y * 20, 20, 20, RAYWHITE);
-                }
-            }
+    metrics_stop_export();
+
+    if (run_ahead > 0) {
+        ahead_copy += window_copy;
+        ahead_run += window_run;
+        ahead_frames += window_ahead_frames;
+        if (ahead_frames > 0) {
+            printf("run-ahead %d: state copy %.2fus, ahead emulation %.2fus per frame over %ld frames\n", run_ahead,
+                   ahead_copy * 1e6 / ahead_frames, ahead_run * 1e6 / ahead_frames, ahead_frames);
         }
+    }
 
-        EndDrawing();
+    if (measure_latency) {
+        printf("latency samples=%llu p50<=%.2fms p99<=%.2fms\n", (unsigned long long)latency.samples,
+               latency_percentile(&latency, 0.5), latency_percentile(&latency, 0.99));
+        if (latency_log != NULL) {
+            fclose(latency_log);
+        }
     }
 
+    UnloadTexture(screen_texture);
+    display_free(&display);
     CloseWindow(); // Close window and OpenGL context
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,196 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+static Metrics *shards[METRICS_MAX_SHARDS];
+static int shard_count;
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t export_thread;
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t export_cond = PTHREAD_COND_INITIALIZER;
+static int exporting;
+static int export_stopping;
+static const char *export_path;
+static double export_interval;
+
+// zeroes the shard and makes it visible to the exporter, shards must outlive the export
+void metrics_register(Metrics *metrics, const char *name) {
+    memset(metrics, 0, sizeof(*metrics));
+    snprintf(metrics->name, sizeof(metrics->name), "%s", name);
+
+    pthread_mutex_lock(&register_lock);
+    if(shard_count < METRICS_MAX_SHARDS) {
+        shards[shard_count] = metrics;
+        __atomic_store_n(&shard_count, shard_count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&register_lock);
+}
+
+static void read_shard(Metrics *copy, const Metrics *shard) {
+    copy->instructions = __atomic_load_n(&shard->instructions, __ATOMIC_RELAXED);
+    copy->frames = __atomic_load_n(&shard->frames, __ATOMIC_RELAXED);
+    copy->draws = __atomic_load_n(&shard->draws, __ATOMIC_RELAXED);
+    copy->collisions = __atomic_load_n(&shard->collisions, __ATOMIC_RELAXED);
+    copy->idle = __atomic_load_n(&shard->idle, __ATOMIC_RELAXED);
+    copy->faults = __atomic_load_n(&shard->faults, __ATOMIC_RELAXED);
+    copy->frame_ns = __atomic_load_n(&shard->frame_ns, __ATOMIC_RELAXED);
+    for(int i = 0; i < METRICS_FRAME_BUCKETS; i++) {
+        copy->frame_time[i] = __atomic_load_n(&shard->frame_time[i], __ATOMIC_RELAXED);
+    }
+    memcpy(copy->name, shard->name, sizeof(copy->name));
+}
+
+// totals over every shard, each shard is read once without stopping its writer
+void metrics_sum(Metrics *total) {
+    int count = __atomic_load_n(&shard_count, __ATOMIC_ACQUIRE);
+    Metrics shard;
+
+    memset(total, 0, sizeof(*total));
+    for(int s = 0; s < count; s++) {
+        read_shard(&shard, shards[s]);
+        total->instructions += shard.instructions;
+        total->frames += shard.frames;
+        total->draws += shard.draws;
+        total->collisions += shard.collisions;
+        total->idle += shard.idle;
+        total->faults += shard.faults;
+        total->frame_ns += shard.frame_ns;
+        for(int i = 0; i < METRICS_FRAME_BUCKETS; i++) {
+            total->frame_time[i] += shard.frame_time[i];
+        }
+    }
+}
+
+static void write_counter(FILE *file, const char *name, const char *help, const Metrics *snapshot, int count,
+                          size_t offset) {
+    fprintf(file, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for(int s = 0; s < count; s++) {
+        fprintf(file, "%s{thread=\"%s\"} %llu\n", name, snapshot[s].name,
+                (unsigned long long)*(const uint64_t *)((const char *)&snapshot[s] + offset));
+    }
+}
+
+// Prometheus text format, written next to the target and renamed over it so readers never see half a file
+static int write_file(const char *path, double instructions_per_second) {
+    static Metrics snapshot[METRICS_MAX_SHARDS];
+    char temporary[1024];
+    int count = __atomic_load_n(&shard_count, __ATOMIC_ACQUIRE);
+
+    for(int s = 0; s < count; s++) {
+        read_shard(&snapshot[s], shards[s]);
+    }
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE *file = fopen(temporary, "w");
+    if(file == NULL) {
+        return -1;
+    }
+
+    write_counter(file, "chip8_instructions_total", "Instructions executed.", snapshot, count,
+                  offsetof(Metrics, instructions));
+    write_counter(file, "chip8_frames_total", "Frames run.", snapshot, count, offsetof(Metrics, frames));
+    write_counter(file, "chip8_draws_total", "DRW instructions executed.", snapshot, count, offsetof(Metrics, draws));
+    write_counter(file, "chip8_draw_collisions_total", "DRW instructions that erased a pixel.", snapshot, count,
+                  offsetof(Metrics, collisions));
+    write_counter(file, "chip8_idle_instructions_total", "Instructions spent waiting for a key or the delay timer.",
+                  snapshot, count, offsetof(Metrics, idle));
+    write_counter(file, "chip8_faults_total", "Machines stopped by a fault.", snapshot, count,
+                  offsetof(Metrics, faults));
+
+    fprintf(file, "# HELP chip8_instructions_per_second Instructions executed per second over the last interval.\n"
+                  "# TYPE chip8_instructions_per_second gauge\nchip8_instructions_per_second %.0f\n",
+            instructions_per_second);
+
+    fprintf(file, "# HELP chip8_frame_seconds Time taken by a frame.\n# TYPE chip8_frame_seconds histogram\n");
+    for(int s = 0; s < count; s++) {
+        uint64_t cumulative = 0;
+        for(int i = 0; i < METRICS_FRAME_BUCKETS; i++) {
+            cumulative += snapshot[s].frame_time[i];
+            if(i < METRICS_FRAME_BUCKETS - 1) {
+                fprintf(file, "chip8_frame_seconds_bucket{thread=\"%s\",le=\"%g\"} %llu\n", snapshot[s].name,
+                        metrics_frame_bounds[i] / 1e9, (unsigned long long)cumulative);
+            } else {
+                fprintf(file, "chip8_frame_seconds_bucket{thread=\"%s\",le=\"+Inf\"} %llu\n", snapshot[s].name,
+                        (unsigned long long)cumulative);
+            }
+        }
+        fprintf(file, "chip8_frame_seconds_sum{thread=\"%s\"} %.9f\n", snapshot[s].name, snapshot[s].frame_ns / 1e9);
+        fprintf(file, "chip8_frame_seconds_count{thread=\"%s\"} %llu\n", snapshot[s].name,
+                (unsigned long long)snapshot[s].frames);
+    }
+
+    if(fclose(file) != 0) {
+        return -1;
+    }
+    return rename(temporary, path);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *export_loop(void *arg) {
+    Metrics total;
+    double last_time = now_seconds();
+    uint64_t last_instructions = 0;
+    (void)arg;
+
+    pthread_mutex_lock(&export_lock);
+    while(!export_stopping) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += (time_t)export_interval;
+        wake.tv_nsec += (long)((export_interval - (time_t)export_interval) * 1e9);
+        if(wake.tv_nsec >= 1000000000L) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&export_cond, &export_lock, &wake);
+
+        // one last file is written on the way out, so the final counts are never lost
+        metrics_sum(&total);
+        double now = now_seconds();
+        double rate = now > last_time ? (total.instructions - last_instructions) / (now - last_time) : 0;
+        last_time = now;
+        last_instructions = total.instructions;
+        if(write_file(export_path, rate) != 0) {
+            fprintf(stderr, "Cannot write %s\n", export_path);
+        }
+    }
+    pthread_mutex_unlock(&export_lock);
+    return NULL;
+}
+
+// write the registered shards to path every interval seconds from a background thread
+int metrics_start_export(const char *path, double interval) {
+    if(exporting) {
+        return -1;
+    }
+    export_path = path;
+    export_interval = interval > 0 ? interval : 1;
+    export_stopping = 0;
+    if(pthread_create(&export_thread, NULL, export_loop, NULL) != 0) {
+        return -1;
+    }
+    exporting = 1;
+    return 0;
+}
+
+void metrics_stop_export(void) {
+    if(!exporting) {
+        return;
+    }
+    pthread_mutex_lock(&export_lock);
+    export_stopping = 1;
+    pthread_cond_signal(&export_cond);
+    pthread_mutex_unlock(&export_lock);
+    pthread_join(export_thread, NULL);
+    exporting = 0;
+}
@@ -0,0 +1,55 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_MAX_SHARDS 256
+#define METRICS_FRAME_BUCKETS 12    // the last one is +Inf
+
+/*
+ * Runtime counters, one shard per thread. A shard is only ever written by the thread that owns it, with relaxed
+ * atomic stores that compile to plain ones, and read by the exporter with relaxed loads. Nothing on the hot path
+ * takes a lock or a locked instruction, and shards are cache line aligned so threads never share a line.
+ *
+ * The core updates draws, collisions and idle through Chip8.metrics (NULL when not collected). Frontends add the
+ * instruction counts their run_fn returns, frames, frame times and faults.
+ */
+typedef struct Metrics
+{
+    uint64_t instructions;
+    uint64_t frames;
+    uint64_t draws;                 // DRW executed
+    uint64_t collisions;            // DRW that erased a pixel
+    uint64_t idle;                  // instructions spent waiting in LD Vx, K or in an Fx07, 3xkk, 1nnn delay timer poll
+    uint64_t faults;
+    uint64_t frame_ns;              // sum of frame times
+    uint64_t frame_time[METRICS_FRAME_BUCKETS];
+    char name[32];                  // thread label
+} __attribute__((aligned(64))) Metrics;
+
+// upper bounds of the frame time buckets in ns, shared with the exporter
+static const uint64_t metrics_frame_bounds[METRICS_FRAME_BUCKETS - 1] =
+{
+    10000, 100000, 1000000, 5000000, 10000000, 15000000, 17000000, 20000000, 34000000, 50000000, 100000000
+};
+
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_frame(Metrics *metrics, uint64_t ns) {
+    int bucket = 0;
+    while(bucket < METRICS_FRAME_BUCKETS - 1 && ns > metrics_frame_bounds[bucket]) {
+        bucket++;
+    }
+    metrics_add(&metrics->frames, 1);
+    metrics_add(&metrics->frame_ns, ns);
+    metrics_add(&metrics->frame_time[bucket], 1);
+}
+
+void metrics_register(Metrics *metrics, const char *name);
+void metrics_sum(Metrics *total);
+int metrics_start_export(const char *path, double interval);
+void metrics_stop_export(void);
+
+#endif
@@ -0,0 +1,203 @@
+#include "program.h"
+
+#include <string.h>
+#include "chip8.h"
+
+static uint16_t read_opcode(const unsigned char *memory, unsigned short addr) {
+    return memory[addr & ADDR_MASK] << 8 | memory[(addr + 1) & ADDR_MASK];
+}
+
+// peephole match at addr, returns the superinstruction kind and sets *length
+static FuseKind match(const Program *program, unsigned short addr, uint8_t *length) {
+    uint16_t first = program->opcode[addr];
+
+    // sequences that would run past the end of memory are left to the interpreter
+    if(addr + 4 > ADDR_MASK) {
+        return FUSE_NONE;
+    }
+    uint16_t second = program->opcode[addr + 2];
+
+    if((first & 0xF000) == 0xA000 && (second & 0xF000) == 0xD000) {
+        *length = 2;
+        return FUSE_LDI_DRW;
+    }
+
+    if((first & 0xF000) == 0x6000 && (second & 0xF000) == 0x6000) {
+        uint8_t n = 2;
+        while(n < FUSE_MAX_RUN && addr + 2 * n + 1 <= ADDR_MASK && (program->opcode[addr + 2 * n] & 0xF000) == 0x6000) {
+            n++;
+        }
+        *length = n;
+        return FUSE_LD_RUN;
+    }
+
+    if(addr + 6 > ADDR_MASK) {
+        return FUSE_NONE;
+    }
+    uint16_t third = program->opcode[addr + 4];
+
+    if((second & 0xF000) == 0x3000 && (third & 0xF000) == 0x1000) {
+        if((first & 0xF0FF) == 0xF007) {
+            *length = 3;
+            return FUSE_TIMER_POLL;
+        }
+        if((first & 0xF000) == 0x7000) {
+            *length = 3;
+            return FUSE_COUNT_LOOP;
+        }
+    }
+    return FUSE_NONE;
+}
+
+void program_build(Program *program, const Chip8 *chip8) {
+    memset(program, 0, sizeof(*program));
+
+    for(int addr = 0; addr < 4096; addr++) {
+        program->opcode[addr] = read_opcode(chip8->memory, addr);
+    }
+
+    // fonts and the reserved area hold no code
+    for(int addr = PROGRAM_START_ADDR; addr < 4096; addr++) {
+        uint8_t length = 0;
+        FuseKind kind = match(program, addr, &length);
+        if(kind != FUSE_NONE) {
+            program->fuse[addr] = kind;
+            program->length[addr] = length;
+            program->found[kind]++;
+        }
+    }
+}
+
+// n bytes at addr were written, re-read the opcodes they are part of and drop superinstructions covering them
+void program_invalidate(Program *program, const unsigned char *memory, unsigned short addr, int n) {
+    for(int a = addr - 1; a < addr + n; a++) {
+        program->opcode[a & ADDR_MASK] = read_opcode(memory, a);
+    }
+    for(int a = addr - (2 * FUSE_MAX_RUN - 1); a < addr + n; a++) {
+        program->fuse[a & ADDR_MASK] = FUSE_NONE;
+    }
+}
+
+static void set_bit(uint8_t *bits, unsigned short addr) {
+    addr &= ADDR_MASK;
+    bits[addr >> 3] |= 1 << (addr & 7);
+}
+
+static int bit(const uint8_t *bits, unsigned short addr) {
+    return (bits[(addr & ADDR_MASK) >> 3] >> (addr & 7)) & 1;
+}
+
+/*
+ * Follow every path from PC_START through the predecoded instructions. Jumps, calls and skips end a block, their
+ * targets and the instructions after them start one. Bnnn targets depend on a register, so the code behind them is
+ * only found if something else reaches it.
+ * Only SUPER-CHIP and XO-CHIP define some of the instructions found on the way, which is what the quirk profile is
+ * inferred from. Anything else keeps the default profile.
+ */
+void program_analyse(const Program *program, ProgramAnalysis *analysis) {
+    uint8_t code[4096 / 8] = { 0 };         // addresses a reachable instruction starts at
+    uint8_t leaders[4096 / 8] = { 0 };      // block starts already queued
+    unsigned short pending[4096];
+    int count = 0;
+    int schip = 0, xochip = 0;
+
+    analysis->computed_jumps = 0;
+
+    pending[count++] = PC_START;
+    set_bit(leaders, PC_START);
+
+    while(count > 0) {
+        unsigned short pc = pending[--count];
+
+        // run down the block until something ends it
+        while(pc + 1 <= ADDR_MASK && !bit(code, pc)) {
+            uint16_t opcode = program->opcode[pc];
+            unsigned short targets[2];
+            int target_count = 0;
+            int falls_through = 1;
+
+            set_bit(code, pc);
+
+            switch(opcode & 0xF000) {
+                case 0x0000:
+                    if(opcode == 0x00EE || opcode == 0x00FD) {
+                        falls_through = 0;
+                    }
+                    if((opcode & 0xFFF0) == 0x00C0 || (opcode >= 0x00FB && opcode <= 0x00FF)) {
+                        schip = 1;
+                    } else if((opcode & 0xFFF0) == 0x00D0) {
+                        xochip = 1;
+                    }
+                    break;
+                case 0x1000:
+                    targets[target_count++] = opcode & 0x0FFF;
+                    falls_through = 0;
+                    break;
+                case 0x2000:
+                    targets[target_count++] = opcode & 0x0FFF;
+                    targets[target_count++] = pc + 2;
+                    falls_through = 0;
+                    break;
+                case 0x3000:
+                case 0x4000:
+                case 0x5000:
+                case 0x9000:
+                case 0xE000:
+                    if((opcode & 0xF00F) == 0x5002 || (opcode & 0xF00F) == 0x5003) {
+                        xochip = 1;
+                        break;
+                    }
+                    targets[target_count++] = pc + 2;
+                    targets[target_count++] = pc + 4;
+                    falls_through = 0;
+                    break;
+                case 0xB000:
+                    analysis->computed_jumps = 1;
+                    falls_through = 0;
+                    break;
+                case 0xD000:
+                    if((opcode & 0x000F) == 0) {
+                        schip = 1;
+                    }
+                    break;
+                case 0xF000:
+                    if(opcode == 0xF000 || (opcode & 0xF0FF) == 0xF001 || opcode == 0xF002 ||
+                       (opcode & 0xF0FF) == 0xF03A) {
+                        xochip = 1;
+                    } else if((opcode & 0xF0FF) == 0xF030 || (opcode & 0xF0FF) == 0xF075 ||
+                              (opcode & 0xF0FF) == 0xF085) {
+                        schip = 1;
+                    }
+                    break;
+            }
+
+            for(int t = 0; t < target_count; t++) {
+                if(!bit(leaders, targets[t])) {
+                    set_bit(leaders, targets[t]);
+                    pending[count++] = targets[t] & ADDR_MASK;
+                }
+            }
+            if(!falls_through) {
+                break;
+            }
+            pc += 2;
+        }
+    }
+
+    analysis->quirks = xochip ? quirks_from_name("xochip") : schip ? quirks_from_name("schip") : 0;
+}
+
+const char *fuse_name(FuseKind kind) {
+    switch(kind) {
+        case FUSE_LDI_DRW:
+            return "LD I + DRW";
+        case FUSE_LD_RUN:
+            return "LD Vx, byte run";
+        case FUSE_TIMER_POLL:
+            return "timer poll";
+        case FUSE_COUNT_LOOP:
+            return "counted loop";
+        default:
+            return "none";
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <stdint.h>
+#include "chip8_context.h"
+
+#define FUSE_MAX_RUN 8              // longest run of 6xkk fused into one superinstruction
+
+// superinstructions, each replaces a short sequence of instructions with one handler
+typedef enum FuseKind
+{
+    FUSE_NONE = 0,
+    FUSE_LDI_DRW,                   // Annn Dxyn
+    FUSE_LD_RUN,                    // 6xkk 6xkk ... (2 to FUSE_MAX_RUN)
+    FUSE_TIMER_POLL,                // Fx07 3ykk 1nnn
+    FUSE_COUNT_LOOP,                // 7xkk 3ykk 1nnn
+    FUSE_COUNT
+} FuseKind;
+
+/*
+ * Predecoded instruction stream of a loaded ROM.
+ * opcode[] holds the instruction starting at every address, fuse[] the superinstruction starting there (if any) and
+ * length[] how many instructions it covers. Writes to memory through Fx33/Fx55 refresh opcode[] and drop any
+ * superinstruction that overlaps them, so self modifying code falls back to the plain interpreter.
+ * Forked machines may share their parent's Program as long as they all run on one thread: invalidation only ever
+ * removes superinstructions, so no machine runs one over bytes another has changed. The counters and tables are
+ * written without synchronisation, so machines on other threads need their own Program or none.
+ */
+typedef struct Program
+{
+    uint16_t opcode[4096];
+    uint8_t fuse[4096];
+    uint8_t length[4096];
+    uint64_t fired[FUSE_COUNT];     // times each superinstruction ran
+    uint32_t found[FUSE_COUNT];     // sites of each superinstruction found in the ROM
+} Program;
+
+// what following the control flow of a ROM from PC_START finds out about it
+typedef struct ProgramAnalysis
+{
+    uint8_t quirks;                 // QUIRK_* profile inferred from the instructions reachable code uses
+    uint8_t computed_jumps;         // reachable code uses Bnnn, whose targets are unknown
+} ProgramAnalysis;
+
+void program_build(Program *program, const Chip8 *chip8);
+void program_invalidate(Program *program, const unsigned char *memory, unsigned short addr, int n);
+void program_analyse(const Program *program, ProgramAnalysis *analysis);
+const char *fuse_name(FuseKind kind);
+
+#endif
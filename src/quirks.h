@@ -0,0 +1,17 @@
+#ifndef QUIRKS_H
+#define QUIRKS_H
+
+/*
+ * Behaviour that differs between CHIP-8 interpreters of different eras.
+ * A ROM picks a combination once at load time, and each combination has its own specialized copy of the
+ * interpreter so the handlers never test these flags while running.
+ */
+#define QUIRK_SHIFT_VY      0x01    // 8xy6/8xyE shift Vy into Vx instead of shifting Vx in place (COSMAC VIP)
+#define QUIRK_LOAD_STORE_I  0x02    // Fx55/Fx65 leave I = I + x + 1 (COSMAC VIP)
+#define QUIRK_JUMP_VX       0x04    // Bxnn jumps to xnn + Vx instead of nnn + V0 (CHIP-48, SUPER-CHIP)
+#define QUIRK_DRAW_WRAP     0x08    // Dxyn wraps sprites around the display edges instead of clipping them
+#define QUIRK_VF_RESET      0x10    // 8xy1/8xy2/8xy3 set VF to 0 (COSMAC VIP)
+
+#define QUIRK_COUNT 32              // number of quirk combinations, one interpreter variant each
+
+#endif
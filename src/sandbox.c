@@ -0,0 +1,69 @@
+#include "sandbox.h"
+
+#include <time.h>
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run an untrusted ROM until it faults or exhausts its budget.
+ * Memory accesses are masked to 12 bits and the stack is bounds checked by the handlers themselves, so the only
+ * per instruction cost here is the fault test inside run. Both budgets are checked once per batch of SANDBOX_BATCH
+ * instructions, the instruction budget is still exact since the last batch is shortened to fit.
+ */
+Chip8Fault sandbox_run(Chip8 *chip8, run_fn run, const SandboxLimits *limits, SandboxResult *result) {
+    unsigned long long executed = 0;
+    double start = now_seconds();
+    double elapsed = 0;
+
+    while(!chip8->fault) {
+        unsigned long long batch = SANDBOX_BATCH;
+        if(limits->max_instructions) {
+            if(executed >= limits->max_instructions) {
+                chip8->fault = FAULT_INSTRUCTION_BUDGET;
+                break;
+            }
+            if(limits->max_instructions - executed < batch) {
+                batch = limits->max_instructions - executed;
+            }
+        }
+
+        // the instruction that faulted did not execute and is not counted by run
+        executed += run(chip8, batch);
+
+        elapsed = now_seconds() - start;
+        if(!chip8->fault && limits->max_seconds > 0 && elapsed >= limits->max_seconds) {
+            chip8->fault = FAULT_TIME_BUDGET;
+        }
+    }
+
+    if(result != NULL) {
+        result->fault = chip8->fault;
+        result->instructions = executed;
+        result->seconds = now_seconds() - start;
+        result->PC = chip8->PC;
+        result->opcode = chip8->opcode;
+    }
+    return chip8->fault;
+}
+
+const char *fault_name(Chip8Fault fault) {
+    switch(fault) {
+        case FAULT_NONE:
+            return "none";
+        case FAULT_ILLEGAL_OPCODE:
+            return "illegal-opcode";
+        case FAULT_STACK_OVERFLOW:
+            return "stack-overflow";
+        case FAULT_STACK_UNDERFLOW:
+            return "stack-underflow";
+        case FAULT_INSTRUCTION_BUDGET:
+            return "instruction-budget";
+        case FAULT_TIME_BUDGET:
+            return "time-budget";
+    }
+    return "unknown";
+}
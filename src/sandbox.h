@@ -0,0 +1,27 @@
+#ifndef SANDBOX_H
+#define SANDBOX_H
+
+#include "chip8.h"
+
+#define SANDBOX_BATCH 4096          // instructions run between budget checks
+
+// a limit of 0 means unlimited
+typedef struct SandboxLimits
+{
+    unsigned long long max_instructions;
+    double max_seconds;             // wall time
+} SandboxLimits;
+
+typedef struct SandboxResult
+{
+    Chip8Fault fault;
+    unsigned long long instructions;    // instructions executed, the faulting one is not counted
+    double seconds;
+    unsigned short PC;                  // where the machine stopped
+    unsigned short opcode;              // last opcode fetched
+} SandboxResult;
+
+Chip8Fault sandbox_run(Chip8 *chip8, run_fn run, const SandboxLimits *limits, SandboxResult *result);
+const char *fault_name(Chip8Fault fault);
+
+#endif
@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "chip8.h"
+#include "fork.h"
+#include "shm_ring.h"
+
+#define MAX_ROMS 64
+
+/*
+ * Serves the machines of a shared memory ring to agents in other processes (see shm_ring.h). Each worker is pinned
+ * to a core and serves a fixed share of the slots, sleeping on its doorbell while none of them has a request.
+ */
+typedef struct Worker
+{
+    pthread_t thread;
+    int index;
+    int cpu;
+    uint64_t requests;
+} Worker;
+
+Chip8 roms[MAX_ROMS];
+int rom_count;
+Worker workers[SHM_RING_MAX_WORKERS];
+ShmRing *ring;
+// the ring's layout as created, agents can write the header so the server never reads it back
+uint32_t slot_count;
+int worker_count;
+uint32_t pending_words;
+size_t ring_size;
+run_fn run;
+int spin;
+volatile int stopping;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void on_signal(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+// slots take turns over the ROMs given, each with its own random number sequence
+static void reset_slot(ShmSlot *slot, int index) {
+    chip8_fork(&slot->chip8, &roms[index % rom_count]);
+    slot->chip8.rng = (slot->chip8.rng ^ (index * 2654435761u) ^ (slot->resets * 0x9E3779B9u)) | 1;
+    slot->steps = 0;
+}
+
+static void serve(ShmSlot *slot, int index) {
+    uint32_t request = __atomic_load_n(&slot->request.value, __ATOMIC_ACQUIRE);
+    uint32_t frames = slot->frames;
+
+    if(slot->command == SHM_RESET) {
+        slot->resets++;
+        reset_slot(slot, index);
+    }
+    // agents can write anything in the slot, so nothing the core would follow or loop on is taken from it
+    slot->chip8.coverage = NULL;
+    slot->chip8.program = NULL;
+    slot->chip8.latency = NULL;
+    slot->chip8.metrics = NULL;
+    slot->chip8.quirks = roms[index % rom_count].quirks;
+    if(slot->chip8.SP > STACK_DEPTH) {
+        // RET would read past the stack
+        slot->chip8.fault = FAULT_STACK_OVERFLOW;
+    }
+    if(frames > SHM_RING_MAX_FRAMES) {
+        frames = SHM_RING_MAX_FRAMES;
+    }
+    slot->ran = run(&slot->chip8, frames);
+    slot->steps += slot->ran;
+    shm_doorbell_set(&slot->done, request);
+}
+
+static void *worker_thread(void *arg) {
+    Worker *worker = (Worker *)arg;
+    ShmDoorbell *bell = &ring->bells[worker->index];
+    uint64_t *pending = (uint64_t *)&ring->slots[slot_count] + (size_t)worker->index * pending_words;
+    uint32_t count = worker_count;
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    // the slots are set up by the worker that serves them, so their memory is first touched on its node
+    for(uint32_t i = worker->index; i < slot_count; i += count) {
+        reset_slot(&ring->slots[i], i);
+    }
+
+    for(;;) {
+        // read before the bitmap, so a request that misses this pass has already moved the bell on
+        uint32_t seen = __atomic_load_n(&bell->value, __ATOMIC_SEQ_CST);
+        int served = 0;
+
+        for(uint32_t w = 0; w < pending_words; w++) {
+            if(__atomic_load_n(&pending[w], __ATOMIC_RELAXED) == 0) {
+                continue;
+            }
+            uint64_t bits = __atomic_exchange_n(&pending[w], 0, __ATOMIC_SEQ_CST);
+            while(bits) {
+                uint32_t index = (w * 64 + __builtin_ctzll(bits)) * count + worker->index;
+                bits &= bits - 1;
+                // the bitmap has room for more bits than the worker has slots, and agents can set any of them
+                if(index >= slot_count) {
+                    continue;
+                }
+                serve(&ring->slots[index], index);
+                served++;
+            }
+        }
+        worker->requests += served;
+
+        if(stopping) {
+            break;
+        }
+        if(!served) {
+            shm_doorbell_wait(bell, seen, spin);
+        }
+    }
+    return NULL;
+}
+
+static int by_value(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Act as an agent: step batch slots at a time with random keys, posting all of them and waking the workers once
+ * before waiting for any, and report the round trip of each batch.
+ */
+static int agent(const char *name, long steps, uint32_t frames, int batch) {
+    ring = shm_ring_attach(name);
+    if(ring == NULL) {
+        printf("Cannot attach to %s\n", name);
+        return EXIT_FAILURE;
+    }
+    // checked against the object's size by shm_ring_attach
+    size_t size = ring->size;
+    if(batch > (int)ring->slot_count) {
+        batch = ring->slot_count;
+    }
+
+    uint64_t *round_trips = (uint64_t *)malloc(sizeof(uint64_t) * steps);
+    uint32_t *sequences = (uint32_t *)malloc(sizeof(uint32_t) * batch);
+    uint64_t random_state = 1;
+    long done = 0;
+    uint64_t start = now_ns();
+
+    for(int s = 0; s < batch; s++) {
+        sequences[s] = shm_ring_post(ring, s, SHM_RESET, 0);
+    }
+    shm_ring_kick(ring);
+    for(int s = 0; s < batch; s++) {
+        shm_ring_wait(ring, s, sequences[s], spin);
+    }
+
+    for(; done < steps; done++) {
+        uint64_t sent = now_ns();
+        for(int s = 0; s < batch; s++) {
+            random_state ^= random_state << 13;
+            random_state ^= random_state >> 7;
+            random_state ^= random_state << 17;
+            shm_ring_set_keys(ring, s, (random_state & 3) ? 0 : 1 << (random_state >> 8) % 16);
+            sequences[s] = shm_ring_post(ring, s, ring->slots[s].chip8.fault ? SHM_RESET : SHM_STEP, frames);
+        }
+        shm_ring_kick(ring);
+        int stopped = 0;
+        for(int s = 0; s < batch; s++) {
+            stopped |= shm_ring_wait(ring, s, sequences[s], spin) != 0;
+        }
+        if(stopped) {
+            printf("Server stopped\n");
+            break;
+        }
+        round_trips[done] = now_ns() - sent;
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+    if(done > 0) {
+        qsort(round_trips, done, sizeof(uint64_t), by_value);
+        printf("batches=%ld batch=%d frames=%u seconds=%.3f machine_steps/s=%.0f\n", done, batch, frames, seconds,
+               done * batch / seconds);
+        printf("round_trip_us p50=%.2f p99=%.2f p999=%.2f max=%.2f\n", round_trips[done / 2] / 1e3,
+               round_trips[done * 99 / 100] / 1e3, round_trips[done * 999 / 1000] / 1e3, round_trips[done - 1] / 1e3);
+    }
+    free(round_trips);
+    free(sequences);
+    shm_ring_detach(ring, size);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char *rom_files[MAX_ROMS];
+    char *name = "/chip8";
+    int slots = 64;
+    int quirks = 0;
+    unsigned int seed = 1;
+    int agent_mode = 0;
+    long steps = 100000;
+    uint32_t frames = 1;
+    int batch = 1;
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    // polling only helps while the other side runs on another core
+    spin = cpus > 1 ? SHM_RING_SPIN : 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
+            name = argv[++i];
+        } else if (strcmp(argv[i], "--slots") == 0 && i + 1 < argc) {
+            slots = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--spin") == 0 && i + 1 < argc) {
+            spin = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = (unsigned int)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            quirks = quirks_from_name(argv[++i]);
+            if (quirks < 0) {
+                printf("Unknown quirk profile %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--agent") == 0) {
+            agent_mode = 1;
+        } else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+            steps = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = (uint32_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = atoi(argv[++i]);
+        } else if (rom_count < MAX_ROMS) {
+            rom_files[rom_count++] = argv[i];
+        }
+    }
+
+    if (agent_mode && steps > 0 && batch > 0) {
+        return agent(name, steps, frames, batch);
+    }
+
+    if (rom_count == 0 || slots <= 0) {
+        printf("Program Usage: ./chip8-shm [--name /name] [--slots n] [--workers n] [--spin n] [--seed n] "
+               "[--quirks profile] path/to/rom...\n"
+               "               ./chip8-shm --agent [--name /name] [--steps n] [--frames n] [--batch n] [--spin n]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int r = 0; r < rom_count; r++) {
+        initialize_chip8(&roms[r]);
+        load_rom(&roms[r], rom_files[r]);
+        roms[r].quirks = quirks;
+        roms[r].rng = seed | 1;
+    }
+    // no Program, superinstruction tables are per ROM image and each slot's memory drifts apart
+    run = select_runner(quirks);
+
+    if (worker_count <= 0) {
+        worker_count = cpus;
+    }
+    if (worker_count > SHM_RING_MAX_WORKERS) {
+        worker_count = SHM_RING_MAX_WORKERS;
+    }
+    if (worker_count > slots) {
+        worker_count = slots;
+    }
+
+    ring = shm_ring_create(name, slots, worker_count);
+    if (ring == NULL) {
+        printf("Cannot create shared memory %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    // no agent can attach before the magic is written, so the header still holds what was created
+    slot_count = ring->slot_count;
+    pending_words = ring->pending_words;
+    ring_size = ring->size;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    int started = 0;
+    for (; started < worker_count; started++) {
+        workers[started].index = started;
+        workers[started].cpu = started % cpus;
+        if (pthread_create(&workers[started].thread, NULL, worker_thread, &workers[started]) != 0) {
+            break;
+        }
+    }
+    if (started < worker_count) {
+        printf("Started %d of %d workers\n", started, worker_count);
+        stopping = 1;
+    } else {
+        // agents attach once the magic is there, slots still being set up only delay their first request
+        __atomic_store_n(&ring->running, 1, __ATOMIC_RELEASE);
+        memcpy(ring->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC));
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        printf("serving %d slots on %s with %d workers\n", slots, name, worker_count);
+        fflush(stdout);
+    }
+
+    struct timespec pause = { 0, 100000000 };
+    while (!stopping) {
+        nanosleep(&pause, NULL);
+    }
+
+    // wake the workers to see stopping, then any agent still waiting for a slot
+    for (int w = 0; w < started; w++) {
+        shm_doorbell_add(&ring->bells[w]);
+    }
+    uint64_t requests = 0;
+    for (int w = 0; w < started; w++) {
+        pthread_join(workers[w].thread, NULL);
+        requests += workers[w].requests;
+    }
+    // done moves by half the sequence space, so it matches no request in flight but wakes whoever waits on it
+    __atomic_store_n(&ring->running, 0, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < slots; i++) {
+        shm_doorbell_set(&ring->slots[i].done, ring->slots[i].done.value + 0x80000000u);
+    }
+
+    printf("requests=%llu\n", (unsigned long long)requests);
+    shm_unlink(name);
+    shm_ring_detach(ring, ring_size);
+    return 0;
+}
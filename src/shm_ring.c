@@ -0,0 +1,201 @@
+#include "shm_ring.h"
+
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// the object is shared between processes, so the futex operations cannot be the private ones
+static long futex(uint32_t *word, int op, uint32_t value) {
+    return syscall(SYS_futex, word, op, value, NULL, NULL, 0);
+}
+
+void shm_doorbell_wake(ShmDoorbell *bell) {
+    if(__atomic_load_n(&bell->sleepers, __ATOMIC_SEQ_CST)) {
+        futex(&bell->value, FUTEX_WAKE, INT_MAX);
+    }
+}
+
+// bump the bell, returns its new value
+uint32_t shm_doorbell_add(ShmDoorbell *bell) {
+    uint32_t value = __atomic_add_fetch(&bell->value, 1, __ATOMIC_SEQ_CST);
+    shm_doorbell_wake(bell);
+    return value;
+}
+
+void shm_doorbell_set(ShmDoorbell *bell, uint32_t value) {
+    __atomic_store_n(&bell->value, value, __ATOMIC_SEQ_CST);
+    shm_doorbell_wake(bell);
+}
+
+/*
+ * Wait for the bell to move on from seen: poll it spin times, then sleep on the futex. Returns the value it was
+ * found at, which may still be seen after a wake without a change, so callers check what they wait for and loop.
+ * sleepers goes up before the last look at value and the ringing side stores value before looking at sleepers,
+ * both sequentially consistent, so a ring is never missed by a waiter going to sleep.
+ */
+uint32_t shm_doorbell_wait(ShmDoorbell *bell, uint32_t seen, int spin) {
+    uint32_t value;
+
+    for(int i = 0; i < spin; i++) {
+        value = __atomic_load_n(&bell->value, __ATOMIC_ACQUIRE);
+        if(value != seen) {
+            return value;
+        }
+        cpu_relax();
+    }
+    __atomic_add_fetch(&bell->sleepers, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&bell->value, __ATOMIC_SEQ_CST) == seen) {
+        futex(&bell->value, FUTEX_WAIT, seen);
+    }
+    __atomic_sub_fetch(&bell->sleepers, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&bell->value, __ATOMIC_ACQUIRE);
+}
+
+static size_t ring_size(int slots, int workers, uint32_t *pending_words) {
+    int per_worker = (slots + workers - 1) / workers;
+    // whole cache lines, so workers never share a bitmap line
+    *pending_words = ((per_worker + 63) / 64 + 7) & ~7u;
+    return sizeof(ShmRing) + sizeof(ShmSlot) * slots + sizeof(uint64_t) * *pending_words * workers;
+}
+
+/*
+ * Create the shared memory object name (as for shm_open) with slots zeroed slots, replacing one left behind by an
+ * earlier server. Returns the mapping, or NULL.
+ */
+ShmRing *shm_ring_create(const char *name, int slots, int workers) {
+    uint32_t pending_words;
+    size_t size = ring_size(slots, workers, &pending_words);
+
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0) {
+        return NULL;
+    }
+    if(ftruncate(fd, size) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    ShmRing *ring = (ShmRing *)mapping;
+    ring->version = SHM_RING_VERSION;
+    ring->chip8_size = sizeof(Chip8);
+    ring->slot_count = slots;
+    ring->worker_count = workers;
+    ring->pending_words = pending_words;
+    ring->size = size;
+    return ring;
+}
+
+// the server writes the magic once the header is filled in, until then agents fail to attach
+ShmRing *shm_ring_attach(const char *name) {
+    struct stat st;
+    int fd = shm_open(name, O_RDWR, 0);
+
+    if(fd < 0) {
+        return NULL;
+    }
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmRing)) {
+        close(fd);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    ShmRing *ring = (ShmRing *)mapping;
+    if(memcmp(ring->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC)) != 0 || ring->version != SHM_RING_VERSION ||
+       ring->chip8_size != sizeof(Chip8) || ring->size != (uint64_t)st.st_size) {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+    return ring;
+}
+
+// size is the one the ring was created or attached with, not ring->size, which anyone attached can overwrite
+void shm_ring_detach(ShmRing *ring, size_t size) {
+    munmap(ring, size);
+}
+
+static int slot_in_range(const ShmRing *ring, int slot) {
+    return slot >= 0 && (uint32_t)slot < ring->slot_count;
+}
+
+/*
+ * Queue a request for slot without waking its worker, shm_ring_kick wakes the workers of everything posted so a
+ * batch costs one wake per worker. Keys are written to the slot's chip8.key before this. Returns the sequence number
+ * to wait for, or 0 without posting anything if slot is out of range.
+ */
+uint32_t shm_ring_post(ShmRing *ring, int slot, ShmCommand command, uint32_t frames) {
+    if(!slot_in_range(ring, slot)) {
+        return 0;
+    }
+
+    ShmSlot *s = &ring->slots[slot];
+    int worker = slot % ring->worker_count;
+    int bit = slot / ring->worker_count;
+
+    s->command = command;
+    s->frames = frames;
+    uint32_t sequence = __atomic_add_fetch(&s->request.value, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_or(&shm_ring_pending(ring, worker)[bit / 64], 1ULL << (bit % 64), __ATOMIC_SEQ_CST);
+    return sequence;
+}
+
+void shm_ring_kick(ShmRing *ring) {
+    for(uint32_t worker = 0; worker < ring->worker_count; worker++) {
+        const uint64_t *pending = shm_ring_pending(ring, worker);
+        for(uint32_t w = 0; w < ring->pending_words; w++) {
+            if(__atomic_load_n(&pending[w], __ATOMIC_SEQ_CST)) {
+                shm_doorbell_add(&ring->bells[worker]);
+                break;
+            }
+        }
+    }
+}
+
+// post a request for slot and wake its worker right away
+uint32_t shm_ring_submit(ShmRing *ring, int slot, ShmCommand command, uint32_t frames) {
+    uint32_t sequence = shm_ring_post(ring, slot, command, frames);
+    if(slot_in_range(ring, slot)) {
+        shm_doorbell_add(&ring->bells[slot % ring->worker_count]);
+    }
+    return sequence;
+}
+
+// wait until the request sequence of slot is done, returns 0, or -1 if the server stopped first or slot is out of range
+int shm_ring_wait(ShmRing *ring, int slot, uint32_t sequence, int spin) {
+    if(!slot_in_range(ring, slot)) {
+        return -1;
+    }
+
+    ShmDoorbell *done = &ring->slots[slot].done;
+    uint32_t value = __atomic_load_n(&done->value, __ATOMIC_ACQUIRE);
+
+    while(value != sequence) {
+        if(!__atomic_load_n(&ring->running, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+        value = shm_doorbell_wait(done, value, spin);
+    }
+    return 0;
+}
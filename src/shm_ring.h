@@ -0,0 +1,94 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "chip8.h"
+
+#define SHM_RING_MAGIC "C8SHMRG"
+#define SHM_RING_VERSION 1
+#define SHM_RING_MAX_WORKERS 64
+#define SHM_RING_MAX_FRAMES 100000  // longest step a request may ask for, so one agent cannot hold a worker
+#define SHM_RING_SPIN 2000          // polls of a doorbell before sleeping on it, on machines with more than one core
+
+// what the server does with a slot when its request is rung
+typedef enum ShmCommand
+{
+    SHM_STEP = 0,                   // run frames frames with the keys in chip8.key
+    SHM_RESET                       // start the slot's ROM over, keys released, then run frames frames
+} ShmCommand;
+
+/*
+ * A futex word on its own cache line. value only ever changes to wake the other side, sleepers counts the
+ * waiters that went to sleep on it, so ringing a bell nobody sleeps on costs no system call.
+ */
+typedef struct ShmDoorbell
+{
+    uint32_t value;
+    uint32_t sleepers;
+} __attribute__((aligned(64))) ShmDoorbell;
+
+/*
+ * One machine. The agent owns the slot while request.value == done.value: it may read the machine and write
+ * chip8.key, command and frames, then ring request. The server owns it until it sets done.value to the same
+ * sequence number. The machine itself lives here, so nothing is copied in either direction. Before every request the
+ * server resets the machine's pointer fields and quirks, faults a machine whose SP is out of range and caps frames at
+ * SHM_RING_MAX_FRAMES. The server keeps its own copy of the ring's layout and skips pending bits past its slots, so
+ * whatever an agent writes to the slot, the header or a bitmap only affects the machines it asks for.
+ */
+typedef struct ShmSlot
+{
+    ShmDoorbell request;            // sequence number of the last request, rung by the agent
+    ShmDoorbell done;               // sequence number of the last completed request, rung by the server
+    uint32_t command;               // ShmCommand
+    uint32_t frames;
+    uint32_t ran;                   // frames the last request ran, fewer if the machine faulted
+    uint32_t resets;
+    uint64_t steps;                 // frames run since the last reset
+    Chip8 chip8;
+} __attribute__((aligned(64))) ShmSlot;
+
+/*
+ * Layout of the shared memory object: this header, the slots, then each worker's pending bitmap. Slot i is served
+ * by worker i % worker_count as bit i / worker_count of its bitmap, which the agent sets before ringing the worker's
+ * bell so the worker finds its requests without scanning every slot. Host byte order and the layout of this build.
+ */
+typedef struct ShmRing
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t chip8_size;            // sizeof(Chip8), a different build of the core does not attach
+    uint32_t slot_count;
+    uint32_t worker_count;
+    uint32_t pending_words;         // uint64_t words per worker bitmap, a multiple of 8
+    uint32_t running;               // cleared when the server stops
+    uint64_t size;                  // bytes mapped
+    ShmDoorbell bells[SHM_RING_MAX_WORKERS];
+    ShmSlot slots[];
+} ShmRing;
+
+static inline uint64_t *shm_ring_pending(ShmRing *ring, int worker) {
+    return (uint64_t *)&ring->slots[ring->slot_count] + (size_t)worker * ring->pending_words;
+}
+
+static inline void shm_ring_set_keys(ShmRing *ring, int slot, unsigned short mask) {
+    for(int k = 0; k < 16; k++) {
+        ring->slots[slot].chip8.key[k] = (mask >> k) & 1;
+    }
+}
+
+ShmRing *shm_ring_create(const char *name, int slots, int workers);
+ShmRing *shm_ring_attach(const char *name);
+void shm_ring_detach(ShmRing *ring, size_t size);
+
+uint32_t shm_doorbell_add(ShmDoorbell *bell);
+void shm_doorbell_set(ShmDoorbell *bell, uint32_t value);
+void shm_doorbell_wake(ShmDoorbell *bell);
+uint32_t shm_doorbell_wait(ShmDoorbell *bell, uint32_t seen, int spin);
+
+uint32_t shm_ring_post(ShmRing *ring, int slot, ShmCommand command, uint32_t frames);
+void shm_ring_kick(ShmRing *ring);
+uint32_t shm_ring_submit(ShmRing *ring, int slot, ShmCommand command, uint32_t frames);
+int shm_ring_wait(ShmRing *ring, int slot, uint32_t sequence, int spin);
+
+#endif
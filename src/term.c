@@ -0,0 +1,340 @@
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <unistd.h>
+#include "chip8.h"
+#include "keymap.h"
+#include "sandbox.h"
+
+#define FRAME_RATE 60
+#define KEY_HOLD_FRAMES 30          // terminals only report presses, a key stays down this long after its last repeat
+#define MAX_ROWS 16
+#define MAX_COLUMNS 64
+#define OUTPUT_SIZE 65536
+#define NO_CELL 0xFFFF              // never a valid cell, forces a cell to be drawn
+
+Chip8 chip8;
+Program program;
+
+/*
+ * The display is drawn with one character per cell. A half-block cell covers 1x2 pixels (64x16 cells), a braille
+ * cell 2x4 pixels (32x8 cells). shown[][] holds what the terminal currently shows, so after the first frame only
+ * the cells that changed are written, with the cheapest cursor movement that gets to them.
+ */
+int braille = 0;
+int rows = 16;
+int columns = 64;
+unsigned short cells[MAX_ROWS][MAX_COLUMNS];
+unsigned short shown[MAX_ROWS][MAX_COLUMNS];
+int cursor_row = -1;                // -1 when the cursor position is unknown
+int cursor_column = -1;
+
+char output[OUTPUT_SIZE];
+size_t output_used;
+
+struct termios saved_termios;
+volatile sig_atomic_t running = 1;
+volatile sig_atomic_t resized = 0;
+
+static void on_signal(int signal) {
+    if(signal == SIGWINCH) {
+        resized = 1;
+    } else {
+        running = 0;
+    }
+}
+
+static void emit(const char *bytes, size_t length) {
+    memcpy(output + output_used, bytes, length);
+    output_used += length;
+}
+
+static void flush_output(void) {
+    size_t done = 0;
+    while(done < output_used) {
+        ssize_t n = write(STDOUT_FILENO, output + done, output_used - done);
+        if(n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    output_used = 0;
+}
+
+static void restore_terminal(void) {
+    emit("\033[0m\033[?25h\033[?1049l", 18);
+    flush_output();
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+}
+
+// raw enough to read single key presses, but Ctrl-C still interrupts
+static int setup_terminal(void) {
+    struct termios raw;
+
+    if(tcgetattr(STDIN_FILENO, &saved_termios) != 0) {
+        return -1;
+    }
+    raw = saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_oflag &= ~OPOST;
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0) {
+        return -1;
+    }
+    // alternate screen, hidden cursor
+    emit("\033[?1049h\033[?25l", 14);
+    return 0;
+}
+
+static void build_cells(const Chip8 *chip8) {
+    for(int row = 0; row < rows; row++) {
+        for(int column = 0; column < columns; column++) {
+            unsigned short cell;
+            if(!braille) {
+                cell = (chip8->gfx[column][row * 2] != 0) | (chip8->gfx[column][row * 2 + 1] != 0) << 1;
+            } else {
+                // braille dot order: 1-3 down the left column, 4-6 down the right one, then 7 and 8 at the bottom
+                int x = column * 2;
+                int y = row * 4;
+                cell = (chip8->gfx[x][y] != 0) | (chip8->gfx[x][y + 1] != 0) << 1 | (chip8->gfx[x][y + 2] != 0) << 2 |
+                       (chip8->gfx[x + 1][y] != 0) << 3 | (chip8->gfx[x + 1][y + 1] != 0) << 4 |
+                       (chip8->gfx[x + 1][y + 2] != 0) << 5 | (chip8->gfx[x][y + 3] != 0) << 6 |
+                       (chip8->gfx[x + 1][y + 3] != 0) << 7;
+            }
+            cells[row][column] = cell;
+        }
+    }
+}
+
+// an empty cell is a plain space, everything else a three byte UTF-8 character
+static inline int cell_size(unsigned short cell) {
+    return cell == 0 ? 1 : 3;
+}
+
+static void emit_cell(unsigned short cell) {
+    if(cell == 0) {
+        output[output_used++] = ' ';
+    } else if(!braille) {
+        // U+2580 upper half, U+2584 lower half, U+2588 full block
+        static const unsigned char half[4] = { 0, 0x80, 0x84, 0x88 };
+        output[output_used++] = (char)0xE2;
+        output[output_used++] = (char)0x96;
+        output[output_used++] = (char)half[cell];
+    } else {
+        // U+2800 + dots
+        output[output_used++] = (char)0xE2;
+        output[output_used++] = (char)(0xA0 | cell >> 6);
+        output[output_used++] = (char)(0x80 | (cell & 0x3F));
+    }
+}
+
+static void move_cursor(int row, int column) {
+    char sequence[16];
+
+    if(row == cursor_row && column == cursor_column) {
+        return;
+    }
+    if(row == cursor_row && column > cursor_column) {
+        // rewriting the unchanged cells in between is often shorter than a cursor forward sequence
+        int length = snprintf(sequence, sizeof(sequence), "\033[%dC", column - cursor_column);
+        int rewrite = 0;
+        for(int c = cursor_column; c < column && rewrite <= length; c++) {
+            rewrite += cell_size(shown[row][c]);
+        }
+        if(rewrite <= length) {
+            for(int c = cursor_column; c < column; c++) {
+                emit_cell(shown[row][c]);
+            }
+        } else {
+            emit(sequence, length);
+        }
+    } else if(row == cursor_row + 1 && column == 0) {
+        emit("\r\n", 2);
+    } else {
+        emit(sequence, snprintf(sequence, sizeof(sequence), "\033[%d;%dH", row + 1, column + 1));
+    }
+    cursor_row = row;
+    cursor_column = column;
+}
+
+// write the cells that differ from what the terminal shows, an unchanged display writes nothing
+static void draw_changes(void) {
+    for(int row = 0; row < rows; row++) {
+        for(int column = 0; column < columns; column++) {
+            unsigned short cell = cells[row][column];
+            if(cell != shown[row][column]) {
+                move_cursor(row, column);
+                emit_cell(cell);
+                shown[row][column] = cell;
+                cursor_column++;
+            }
+        }
+    }
+}
+
+static void redraw_all(void) {
+    emit("\033[H\033[2J", 7);
+    cursor_row = 0;
+    cursor_column = 0;
+    memset(shown, 0xFF, sizeof(shown));
+}
+
+static void show_status(const char *status) {
+    char sequence[16];
+    emit(sequence, snprintf(sequence, sizeof(sequence), "\033[%d;1H\033[K", rows + 2));
+    emit(status, strlen(status));
+    cursor_row = rows + 1;
+    cursor_column = strlen(status);
+}
+
+// a key press or repeat holds its CHIP-8 key down for the next KEY_HOLD_FRAMES frames, ESC quits
+static void read_keys(int *hold) {
+    unsigned char buffer[64];
+    ssize_t n;
+
+    while((n = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
+        for(ssize_t i = 0; i < n; i++) {
+            if(buffer[i] == 27) {
+                // a lone ESC quits, escape sequences of arrow and function keys are dropped
+                if(i == n - 1) {
+                    running = 0;
+                }
+                break;
+            }
+            for(int k = 0; k < 16; k++) {
+                if(toupper(buffer[i]) == chip8_keymap[k]) {
+                    hold[k] = KEY_HOLD_FRAMES;
+                }
+            }
+        }
+    }
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    char *rom_file = NULL;
+    int quirks = 0;
+    int speed = 1;                  // frames emulated per presented frame
+    int hold[16] = { 0 };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--braille") == 0) {
+            braille = 1;
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            quirks = quirks_from_name(argv[++i]);
+            if (quirks < 0) {
+                printf("Unknown quirk profile %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--turbo") == 0 && i + 1 < argc) {
+            speed = atoi(argv[++i]);
+            if (speed < 1) {
+                speed = 1;
+            }
+        } else {
+            rom_file = argv[i];
+        }
+    }
+
+    if (rom_file == NULL) {
+        printf("Program Usage: ./chip8-term [--braille] [--quirks profile] [--turbo n] path/to/rom\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (braille) {
+        rows = 8;
+        columns = 32;
+    }
+
+    initialize_chip8(&chip8);
+    load_rom(&chip8, rom_file);
+    chip8.quirks = quirks;
+    program_build(&program, &chip8);
+    chip8.program = &program;
+    run_fn run_frames = select_runner(chip8.quirks);
+
+    if (setup_terminal() != 0) {
+        printf("Standard input is not a terminal\n");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGWINCH, on_signal);
+    redraw_all();
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    double window_start = now_seconds();
+    long window_bytes = 0;
+    long presented = 0;
+    long long total_bytes = 0;
+
+    while (running) {
+        read_keys(hold);
+        for (int k = 0; k < 16; k++) {
+            chip8.key[k] = hold[k] > 0;
+            if (hold[k] > 0) {
+                hold[k]--;
+            }
+        }
+
+        unsigned char sound_timer = chip8.sound_timer;
+        run_frames(&chip8, speed);
+        if (chip8.fault) {
+            break;
+        }
+
+        if (resized) {
+            resized = 0;
+            redraw_all();
+        }
+        build_cells(&chip8);
+        draw_changes();
+        if (sound_timer > 0 && chip8.sound_timer == 0) {
+            emit("\a", 1);
+        }
+
+        // throughput of the link, refreshed once a second so the status line costs next to nothing
+        double now = now_seconds();
+        if (now - window_start >= 1.0) {
+            char status[64];
+            snprintf(status, sizeof(status), "%.0f bytes/frame  ESC quits", window_bytes / ((now - window_start) * FRAME_RATE));
+            show_status(status);
+            window_start = now;
+            window_bytes = 0;
+        }
+
+        window_bytes += output_used;
+        total_bytes += output_used;
+        presented++;
+        flush_output();
+
+        deadline.tv_nsec += 1000000000L / FRAME_RATE;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        // after a stall (a suspended process, a blocked link) start pacing from now instead of catching up
+        if (now - (deadline.tv_sec + deadline.tv_nsec / 1e9) > 1.0 / FRAME_RATE) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+
+    restore_terminal();
+    if (chip8.fault) {
+        printf("Stopped at 0x%03X (opcode 0x%04X): %s\n", chip8.PC, chip8.opcode, fault_name(chip8.fault));
+    }
+    printf("%ld frames, %.1f bytes/frame\n", presented, presented ? (double)total_bytes / presented : 0.0);
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include "timer_wheel.h"
+
+#include <string.h>
+
+void wheel_init(TimerWheel *wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+// an entry that is already due fires on the next tick, the current one has been collected
+void wheel_add(TimerWheel *wheel, TimerEntry *entry) {
+    if(entry->expires <= wheel->now) {
+        entry->expires = wheel->now + 1;
+    }
+    uint64_t delta = entry->expires - wheel->now;
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    // beyond the top level the entry waits in the furthest slot and is cascaded again when that comes round
+    uint64_t expires = entry->expires;
+    if(delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) {
+        expires = wheel->now + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    TimerEntry **slot = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    entry->next = *slot;
+    *slot = entry;
+}
+
+static void cascade(TimerWheel *wheel, int level) {
+    TimerEntry **slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    TimerEntry *entry = *slot;
+
+    *slot = NULL;
+    while(entry != NULL) {
+        TimerEntry *next = entry->next;
+        if(entry->expires == wheel->now) {
+            // due right now, keep it in the slot about to be collected
+            TimerEntry **due = &wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)];
+            entry->next = *due;
+            *due = entry;
+        } else {
+            wheel_add(wheel, entry);
+        }
+        entry = next;
+    }
+}
+
+/*
+ * Move to the next tick and return every entry that expires on it as one list, or NULL. The entries are no longer
+ * in the wheel, add them again to reschedule.
+ */
+TimerEntry *wheel_advance(TimerWheel *wheel) {
+    int top = 0;
+
+    wheel->now++;
+    while(top < WHEEL_LEVELS - 1 && (wheel->now & (((uint64_t)1 << (WHEEL_BITS * (top + 1))) - 1)) == 0) {
+        top++;
+    }
+    // from the top down, so entries a higher level hands down are cascaded again on this same tick
+    for(int level = top; level > 0; level--) {
+        cascade(wheel, level);
+    }
+
+    TimerEntry **slot = &wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)];
+    TimerEntry *due = *slot;
+    *slot = NULL;
+    return due;
+}
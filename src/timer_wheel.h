@@ -0,0 +1,34 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4              // 2^24 ticks ahead, hours at a millisecond tick
+
+/*
+ * Hierarchical timer wheel, the classic cascading kind. Level 0 has one slot per tick for the next 64 ticks, each
+ * level above covers 64 times the span of the one below with one slot per 64 of its ticks. When level 0 wraps,
+ * the current slot of level 1 is redistributed into level 0, and so on upwards. Adding a timer and collecting the
+ * ones due are O(1), however many timers there are.
+ *
+ * Entries are intrusive and singly linked, a wheel belongs to one thread.
+ */
+typedef struct TimerEntry
+{
+    struct TimerEntry *next;
+    uint64_t expires;               // tick
+} TimerEntry;
+
+typedef struct TimerWheel
+{
+    uint64_t now;                   // last tick collected
+    TimerEntry *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+void wheel_init(TimerWheel *wheel, uint64_t now);
+void wheel_add(TimerWheel *wheel, TimerEntry *entry);
+TimerEntry *wheel_advance(TimerWheel *wheel);
+
+#endif
@@ -0,0 +1,327 @@
+#include "trace.h"
+
+#include <string.h>
+#include <zlib.h>
+
+static unsigned short key_mask(const Chip8 *chip8) {
+    unsigned short mask = 0;
+    for(int k = 0; k < 16; k++) {
+        mask |= (chip8->key[k] != 0) << k;
+    }
+    return mask;
+}
+
+static void capture_state(TraceState *state, const Chip8 *chip8) {
+    memcpy(state->V, chip8->V, 16);
+    state->I = chip8->I;
+    state->SP = chip8->SP;
+    state->delay_timer = chip8->delay_timer;
+    state->sound_timer = chip8->sound_timer;
+    state->keys = key_mask(chip8);
+}
+
+static void start_chunk(TraceWriter *writer, unsigned short PC) {
+    memset(&writer->header, 0, sizeof(writer->header));
+    writer->header.first_step = writer->steps;
+    writer->header.PC = PC;
+    writer->header.I = writer->last.I;
+    memcpy(writer->header.V, writer->last.V, 16);
+    writer->header.SP = writer->last.SP;
+    writer->header.delay_timer = writer->last.delay_timer;
+    writer->header.sound_timer = writer->last.sound_timer;
+    writer->header.keys = writer->last.keys;
+    writer->raw_used = 0;
+}
+
+static void *writer_thread(void *arg) {
+    TraceWriter *writer = (TraceWriter *)arg;
+    uLongf capacity = compressBound(TRACE_CHUNK_RECORDS * TRACE_MAX_RECORD);
+    unsigned char *compressed = (unsigned char *)malloc(capacity);
+
+    pthread_mutex_lock(&writer->lock);
+    for(;;) {
+        while(!writer->has_pending && !writer->closing) {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        }
+        if(!writer->has_pending) {
+            break;
+        }
+        TraceChunkHeader header = writer->pending_header;
+        pthread_mutex_unlock(&writer->lock);
+
+        // compress and write outside the lock, the emulator only waits if it fills another chunk meanwhile
+        uLongf size = capacity;
+        if(compressed == NULL || compress2(compressed, &size, writer->pending_raw, header.raw_size, 1) != Z_OK) {
+            writer->error = 1;
+        } else {
+            header.compressed_size = size;
+            if(fwrite(&header, sizeof(header), 1, writer->file) != 1 || fwrite(compressed, 1, size, writer->file) != size) {
+                writer->error = 1;
+            }
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        writer->has_pending = 0;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    free(compressed);
+    return NULL;
+}
+
+// hand the filled chunk to the writer thread and start a new one in the other buffer
+static void flush_chunk(TraceWriter *writer, unsigned short next_PC) {
+    if(writer->header.records == 0) {
+        return;
+    }
+    writer->header.raw_size = writer->raw_used;
+
+    pthread_mutex_lock(&writer->lock);
+    while(writer->has_pending) {
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    unsigned char *filled = writer->raw;
+    writer->raw = writer->pending_raw;
+    writer->pending_raw = filled;
+    writer->pending_header = writer->header;
+    writer->has_pending = 1;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+
+    start_chunk(writer, next_PC);
+}
+
+int trace_open(TraceWriter *writer, const char *path, const Chip8 *chip8) {
+    TraceFileHeader file_header;
+
+    memset(writer, 0, sizeof(*writer));
+    writer->file = fopen(path, "wb");
+    if(writer->file == NULL) {
+        return -1;
+    }
+    // the trace is written in large chunks already, stdio buffering would only add a copy
+    setvbuf(writer->file, NULL, _IONBF, 0);
+
+    writer->raw = (unsigned char *)malloc(TRACE_CHUNK_RECORDS * TRACE_MAX_RECORD);
+    writer->pending_raw = (unsigned char *)malloc(TRACE_CHUNK_RECORDS * TRACE_MAX_RECORD);
+    if(writer->raw == NULL || writer->pending_raw == NULL) {
+        fclose(writer->file);
+        free(writer->raw);
+        free(writer->pending_raw);
+        return -1;
+    }
+
+    memset(&file_header, 0, sizeof(file_header));
+    memcpy(file_header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    file_header.version = TRACE_VERSION;
+    file_header.chunk_records = TRACE_CHUNK_RECORDS;
+    fwrite(&file_header, sizeof(file_header), 1, writer->file);
+
+    capture_state(&writer->last, chip8);
+    start_chunk(writer, chip8->PC);
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if(pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+        fclose(writer->file);
+        free(writer->raw);
+        free(writer->pending_raw);
+        return -1;
+    }
+    return 0;
+}
+
+static inline unsigned char *put16(unsigned char *p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+    return p + 2;
+}
+
+// run one instruction and append what it changed
+void trace_step(TraceWriter *writer, Chip8 *chip8, emulate_fn step) {
+    unsigned short PC = chip8->PC;
+    unsigned short I = chip8->I;
+    unsigned short keys = key_mask(chip8);
+    TraceState *last = &writer->last;
+
+    step(chip8);
+
+    unsigned char *p = writer->raw + writer->raw_used;
+    unsigned char *flags;
+    uint16_t vmask = 0;
+
+    for(int i = 0; i < 16; i++) {
+        vmask |= (chip8->V[i] != last->V[i]) << i;
+    }
+
+    p = put16(p, PC);
+    p = put16(p, chip8->opcode);
+    p = put16(p, vmask);
+    flags = p++;
+    *flags = 0;
+
+    for(int i = 0; i < 16; i++) {
+        if(vmask & (1 << i)) {
+            *p++ = chip8->V[i];
+        }
+    }
+    if(chip8->I != last->I) {
+        *flags |= TRACE_I;
+        p = put16(p, chip8->I);
+    }
+    if(chip8->SP != last->SP) {
+        *flags |= TRACE_SP;
+        *p++ = chip8->SP;
+    }
+    if(chip8->delay_timer != last->delay_timer) {
+        *flags |= TRACE_DT;
+        *p++ = chip8->delay_timer;
+    }
+    if(chip8->sound_timer != last->sound_timer) {
+        *flags |= TRACE_ST;
+        *p++ = chip8->sound_timer;
+    }
+    if(!chip8->fault) {
+        // Fx33 and Fx55 are the only instructions that write memory, both at the I they started with
+        int length = 0;
+        if((chip8->opcode & 0xF0FF) == 0xF033) {
+            length = 3;
+        } else if((chip8->opcode & 0xF0FF) == 0xF055) {
+            length = ((chip8->opcode & 0x0F00) >> 8) + 1;
+        }
+        if(length) {
+            *flags |= TRACE_MEMORY;
+            p = put16(p, I & ADDR_MASK);
+            *p++ = length;
+            for(int i = 0; i < length; i++) {
+                *p++ = chip8->memory[(I + i) & ADDR_MASK];
+            }
+        }
+        if((chip8->opcode & 0xF000) == 0x2000) {
+            *flags |= TRACE_STACK;
+            p = put16(p, chip8->stack[chip8->SP]);
+        }
+    } else {
+        *flags |= TRACE_FAULT;
+        *p++ = chip8->fault;
+    }
+    if(keys != last->keys) {
+        *flags |= TRACE_KEYS;
+        p = put16(p, keys);
+    }
+
+    capture_state(last, chip8);
+    last->keys = keys;
+    writer->raw_used = p - writer->raw;
+    writer->steps++;
+
+    if(++writer->header.records == TRACE_CHUNK_RECORDS) {
+        flush_chunk(writer, chip8->PC);
+    }
+}
+
+int trace_close(TraceWriter *writer) {
+    flush_chunk(writer, 0);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = 1;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->cond);
+    if(fclose(writer->file) != 0) {
+        writer->error = 1;
+    }
+    free(writer->raw);
+    free(writer->pending_raw);
+    return writer->error ? -1 : 0;
+}
+
+void trace_state_from_header(TraceState *state, const TraceChunkHeader *header) {
+    memcpy(state->V, header->V, 16);
+    state->I = header->I;
+    state->SP = header->SP;
+    state->delay_timer = header->delay_timer;
+    state->sound_timer = header->sound_timer;
+    state->keys = header->keys;
+}
+
+static inline uint16_t get16(const unsigned char *p) {
+    return p[0] | p[1] << 8;
+}
+
+/*
+ * Decode the record at p into record and apply it to state.
+ * Returns the start of the next record, or NULL if the record is truncated. record->step is left to the caller.
+ */
+const unsigned char *trace_decode_record(const unsigned char *p, const unsigned char *end, TraceState *state,
+                                         TraceRecord *record) {
+    if(end - p < 7) {
+        return NULL;
+    }
+    record->PC = get16(p);
+    record->opcode = get16(p + 2);
+    record->vmask = get16(p + 4);
+    record->flags = p[6];
+    p += 7;
+
+    // fixed size fields, the bytes of a memory write are checked once their count is known
+    int need = __builtin_popcount(record->vmask);
+    need += (record->flags & TRACE_I) ? 2 : 0;
+    need += (record->flags & TRACE_SP) ? 1 : 0;
+    need += (record->flags & TRACE_DT) ? 1 : 0;
+    need += (record->flags & TRACE_ST) ? 1 : 0;
+    need += (record->flags & TRACE_MEMORY) ? 3 : 0;
+    need += (record->flags & TRACE_STACK) ? 2 : 0;
+    need += (record->flags & TRACE_FAULT) ? 1 : 0;
+    need += (record->flags & TRACE_KEYS) ? 2 : 0;
+    if(end - p < need) {
+        return NULL;
+    }
+
+    for(int i = 0; i < 16; i++) {
+        if(record->vmask & (1 << i)) {
+            state->V[i] = *p++;
+        }
+    }
+    if(record->flags & TRACE_I) {
+        state->I = get16(p);
+        p += 2;
+    }
+    if(record->flags & TRACE_SP) {
+        state->SP = *p++;
+    }
+    if(record->flags & TRACE_DT) {
+        state->delay_timer = *p++;
+    }
+    if(record->flags & TRACE_ST) {
+        state->sound_timer = *p++;
+    }
+    record->memory_length = 0;
+    if(record->flags & TRACE_MEMORY) {
+        record->memory_address = get16(p);
+        record->memory_length = p[2];
+        p += 3;
+        if(record->memory_length > 16 || end - p < record->memory_length) {
+            return NULL;
+        }
+        memcpy(record->memory, p, record->memory_length);
+        p += record->memory_length;
+    }
+    if(record->flags & TRACE_STACK) {
+        record->stack = get16(p);
+        p += 2;
+    }
+    record->fault = 0;
+    if(record->flags & TRACE_FAULT) {
+        record->fault = *p++;
+    }
+    if(record->flags & TRACE_KEYS) {
+        state->keys = get16(p);
+        p += 2;
+    }
+    return p;
+}
@@ -0,0 +1,119 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "chip8.h"
+
+/*
+ * Binary execution trace, host (little endian) byte order.
+ *
+ * file   := TraceFileHeader chunk*
+ * chunk  := TraceChunkHeader, compressed_size bytes of zlib data that inflate to raw_size bytes of records
+ * record := PC:u16 opcode:u16 vmask:u16 flags:u8, then
+ *           one byte per bit set in vmask (new V0..VF, ascending)
+ *           TRACE_I      new I:u16
+ *           TRACE_SP     new SP:u8
+ *           TRACE_DT     new delay timer:u8
+ *           TRACE_ST     new sound timer:u8
+ *           TRACE_MEMORY address:u16 length:u8 then the bytes written
+ *           TRACE_STACK  address pushed by CALL:u16
+ *           TRACE_FAULT  Chip8Fault:u8
+ *           TRACE_KEYS   key mask the instruction ran with:u16
+ *
+ * Every chunk holds TRACE_CHUNK_RECORDS records (the last one fewer) and starts with a snapshot of the registers,
+ * so chunks of two traces line up by step and can be compared, or skipped when identical, on their own.
+ */
+#define TRACE_MAGIC "C8TRACE"
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_RECORDS 65536
+#define TRACE_MAX_RECORD 64         // largest possible encoded record
+
+#define TRACE_I      0x01
+#define TRACE_SP     0x02
+#define TRACE_DT     0x04
+#define TRACE_ST     0x08
+#define TRACE_MEMORY 0x10
+#define TRACE_STACK  0x20
+#define TRACE_FAULT  0x40
+#define TRACE_KEYS   0x80
+
+typedef struct TraceFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_records;
+} TraceFileHeader;
+
+// registers a record is encoded against
+typedef struct TraceState
+{
+    uint8_t V[16];
+    uint16_t I;
+    uint8_t SP;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint16_t keys;
+} TraceState;
+
+typedef struct TraceChunkHeader
+{
+    uint64_t first_step;
+    uint32_t records;
+    uint32_t raw_size;
+    uint32_t compressed_size;
+    uint16_t PC;                    // snapshot before the chunk's first record
+    uint16_t I;
+    uint8_t V[16];
+    uint8_t SP;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t reserved;
+    uint16_t keys;
+    uint16_t reserved2;
+} TraceChunkHeader;
+
+typedef struct TraceRecord
+{
+    uint64_t step;
+    uint16_t PC;
+    uint16_t opcode;
+    uint16_t vmask;
+    uint8_t flags;
+    uint8_t fault;
+    uint16_t stack;
+    uint16_t memory_address;
+    uint8_t memory_length;
+    uint8_t memory[16];
+} TraceRecord;
+
+typedef struct TraceWriter
+{
+    FILE *file;
+    TraceState last;                // registers after the previous step
+    uint64_t steps;
+    TraceChunkHeader header;        // chunk being filled
+    unsigned char *raw;
+    size_t raw_used;
+
+    // chunks are compressed and written by a background thread while the next one fills up
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char *pending_raw;
+    TraceChunkHeader pending_header;
+    int has_pending;
+    int closing;
+    int error;
+} TraceWriter;
+
+int trace_open(TraceWriter *writer, const char *path, const Chip8 *chip8);
+void trace_step(TraceWriter *writer, Chip8 *chip8, emulate_fn step);
+int trace_close(TraceWriter *writer);
+
+const unsigned char *trace_decode_record(const unsigned char *p, const unsigned char *end, TraceState *state,
+                                         TraceRecord *record);
+void trace_state_from_header(TraceState *state, const TraceChunkHeader *header);
+
+#endif
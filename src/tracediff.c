@@ -0,0 +1,310 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "trace.h"
+
+#define MAX_CONTEXT 64
+
+typedef struct TraceFile
+{
+    const char *path;
+    const unsigned char *data;
+    size_t size;
+    size_t offset;                  // next chunk header
+    unsigned char *raw;             // inflated records of the current chunk
+    size_t raw_capacity;
+} TraceFile;
+
+typedef struct Decoded
+{
+    TraceRecord record;
+    TraceState state;               // registers after the record
+} Decoded;
+
+Decoded context[MAX_CONTEXT];
+int context_size = 8;
+uint64_t context_count;
+
+static int open_trace(TraceFile *trace, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    memset(trace, 0, sizeof(*trace));
+    trace->path = path;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        printf("Cannot open %s\n", path);
+        return -1;
+    }
+    trace->size = st.st_size;
+    if(trace->size < sizeof(TraceFileHeader)) {
+        printf("%s is not a trace\n", path);
+        close(fd);
+        return -1;
+    }
+    trace->data = (const unsigned char *)mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(trace->data == MAP_FAILED) {
+        printf("Cannot map %s\n", path);
+        return -1;
+    }
+    // chunks are visited once, front to back
+    madvise((void *)trace->data, trace->size, MADV_SEQUENTIAL);
+
+    const TraceFileHeader *header = (const TraceFileHeader *)trace->data;
+    if(memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || header->version != TRACE_VERSION) {
+        printf("%s is not a version %d trace\n", path, TRACE_VERSION);
+        return -1;
+    }
+    trace->offset = sizeof(TraceFileHeader);
+    return 0;
+}
+
+// returns the next chunk header, or NULL at the end of the trace
+static const TraceChunkHeader *next_chunk(TraceFile *trace) {
+    if(trace->size - trace->offset < sizeof(TraceChunkHeader)) {
+        return NULL;
+    }
+    const TraceChunkHeader *header = (const TraceChunkHeader *)(trace->data + trace->offset);
+    if(trace->size - trace->offset - sizeof(TraceChunkHeader) < header->compressed_size) {
+        printf("%s is truncated\n", trace->path);
+        return NULL;
+    }
+    return header;
+}
+
+static const unsigned char *chunk_data(const TraceFile *trace) {
+    return trace->data + trace->offset + sizeof(TraceChunkHeader);
+}
+
+static void skip_chunk(TraceFile *trace, const TraceChunkHeader *header) {
+    trace->offset += sizeof(TraceChunkHeader) + header->compressed_size;
+}
+
+static int inflate_chunk(TraceFile *trace, const TraceChunkHeader *header) {
+    if(trace->raw_capacity < header->raw_size) {
+        free(trace->raw);
+        trace->raw = (unsigned char *)malloc(header->raw_size);
+        trace->raw_capacity = trace->raw == NULL ? 0 : header->raw_size;
+    }
+    uLongf size = header->raw_size;
+    if(trace->raw == NULL || uncompress(trace->raw, &size, chunk_data(trace), header->compressed_size) != Z_OK ||
+       size != header->raw_size) {
+        printf("%s: chunk at step %llu is corrupt\n", trace->path, (unsigned long long)header->first_step);
+        return -1;
+    }
+    return 0;
+}
+
+static void remember(const TraceRecord *record, const TraceState *state) {
+    Decoded *slot = &context[context_count % MAX_CONTEXT];
+    slot->record = *record;
+    slot->state = *state;
+    context_count++;
+}
+
+static void print_record(const char *label, const TraceRecord *record, const TraceState *state) {
+    printf("%s step %llu pc=0x%03X opcode=0x%04X", label, (unsigned long long)record->step, record->PC, record->opcode);
+    for(int i = 0; i < 16; i++) {
+        if(record->vmask & (1 << i)) {
+            printf(" V%X=%02X", i, state->V[i]);
+        }
+    }
+    if(record->flags & TRACE_I) {
+        printf(" I=%03X", state->I);
+    }
+    if(record->flags & TRACE_SP) {
+        printf(" SP=%d", state->SP);
+    }
+    if(record->flags & TRACE_DT) {
+        printf(" DT=%d", state->delay_timer);
+    }
+    if(record->flags & TRACE_ST) {
+        printf(" ST=%d", state->sound_timer);
+    }
+    if(record->flags & TRACE_MEMORY) {
+        printf(" [%03X]=", record->memory_address);
+        for(int i = 0; i < record->memory_length; i++) {
+            printf("%02X", record->memory[i]);
+        }
+    }
+    if(record->flags & TRACE_STACK) {
+        printf(" push=%03X", record->stack);
+    }
+    if(record->flags & TRACE_FAULT) {
+        printf(" fault=%d", record->fault);
+    }
+    if(record->flags & TRACE_KEYS) {
+        printf(" keys=%04X", state->keys);
+    }
+    printf("\n");
+}
+
+static void print_state(const char *label, const TraceState *state) {
+    printf("%s", label);
+    for(int i = 0; i < 16; i++) {
+        printf(" V%X=%02X", i, state->V[i]);
+    }
+    printf(" I=%03X SP=%d DT=%d ST=%d keys=%04X\n", state->I, state->SP, state->delay_timer, state->sound_timer,
+           state->keys);
+}
+
+static void print_context(void) {
+    uint64_t first = context_count > (uint64_t)context_size ? context_count - context_size : 0;
+    for(uint64_t i = first; i < context_count; i++) {
+        print_record("   ", &context[i % MAX_CONTEXT].record, &context[i % MAX_CONTEXT].state);
+    }
+}
+
+// decode a chunk of a only to fill the context, used when the chunk before a divergent one was skipped
+static int fill_context(TraceFile *a, const TraceChunkHeader *header) {
+    TraceState state;
+    TraceRecord record;
+
+    if(inflate_chunk(a, header) != 0) {
+        return -1;
+    }
+    trace_state_from_header(&state, header);
+    const unsigned char *p = a->raw;
+    const unsigned char *end = a->raw + header->raw_size;
+    for(uint32_t i = 0; i < header->records && p != NULL; i++) {
+        p = trace_decode_record(p, end, &state, &record);
+        record.step = header->first_step + i;
+        if(p != NULL && i + context_size >= header->records) {
+            remember(&record, &state);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Compare two traces chunk by chunk. Chunks whose header and compressed bytes are identical are skipped without
+ * being inflated, so only the chunk holding the first difference is decoded record by record.
+ * Returns 0 if the traces are identical, 1 if they diverge and 2 on errors.
+ */
+static int compare(TraceFile *a, TraceFile *b) {
+    const TraceChunkHeader *previous = NULL;
+    int previous_skipped = 0;
+    uint64_t steps = 0;
+
+    for(;;) {
+        const TraceChunkHeader *ha = next_chunk(a);
+        const TraceChunkHeader *hb = next_chunk(b);
+
+        if(ha == NULL || hb == NULL) {
+            if(ha == NULL && hb == NULL) {
+                printf("traces are identical, %llu steps\n", (unsigned long long)steps);
+                return 0;
+            }
+            printf("%s ends at step %llu, the other trace continues\n", (ha == NULL ? a : b)->path,
+                   (unsigned long long)steps);
+            return 1;
+        }
+
+        if(memcmp(ha, hb, sizeof(TraceChunkHeader)) == 0 && memcmp(chunk_data(a), chunk_data(b), ha->compressed_size) == 0) {
+            steps += ha->records;
+            previous = ha;
+            previous_skipped = 1;
+            skip_chunk(a, ha);
+            skip_chunk(b, hb);
+            continue;
+        }
+
+        if(previous != NULL && previous_skipped) {
+            TraceFile earlier = *a;
+            earlier.offset = (const unsigned char *)previous - a->data;
+            if(fill_context(&earlier, previous) != 0) {
+                return 2;
+            }
+            a->raw = earlier.raw;
+            a->raw_capacity = earlier.raw_capacity;
+        }
+
+        if(inflate_chunk(a, ha) != 0 || inflate_chunk(b, hb) != 0) {
+            return 2;
+        }
+
+        TraceState sa, sb;
+        TraceRecord ra, rb;
+        trace_state_from_header(&sa, ha);
+        trace_state_from_header(&sb, hb);
+        const unsigned char *pa = a->raw;
+        const unsigned char *pb = b->raw;
+        const unsigned char *end_a = a->raw + ha->raw_size;
+        const unsigned char *end_b = b->raw + hb->raw_size;
+
+        if(memcmp(&sa, &sb, sizeof(TraceState)) != 0 || ha->PC != hb->PC) {
+            printf("registers already differ before step %llu\n", (unsigned long long)ha->first_step);
+            print_context();
+            print_state("A:", &sa);
+            print_state("B:", &sb);
+            return 1;
+        }
+
+        uint32_t records = ha->records < hb->records ? ha->records : hb->records;
+        for(uint32_t i = 0; i < records; i++) {
+            const unsigned char *next_a = trace_decode_record(pa, end_a, &sa, &ra);
+            const unsigned char *next_b = trace_decode_record(pb, end_b, &sb, &rb);
+            ra.step = rb.step = ha->first_step + i;
+            if(next_a == NULL || next_b == NULL) {
+                printf("%s: record %llu is truncated\n", (next_a == NULL ? a : b)->path, (unsigned long long)ra.step);
+                return 2;
+            }
+
+            if(next_a - pa != next_b - pb || memcmp(pa, pb, next_a - pa) != 0) {
+                printf("first divergence at step %llu\n", (unsigned long long)ra.step);
+                print_context();
+                print_record("A: ", &ra, &sa);
+                print_record("B: ", &rb, &sb);
+                print_state("A after:", &sa);
+                print_state("B after:", &sb);
+                return 1;
+            }
+
+            remember(&ra, &sa);
+            pa = next_a;
+            pb = next_b;
+        }
+
+        steps += records;
+        if(ha->records != hb->records) {
+            printf("%s ends at step %llu, the other trace continues\n",
+                   (ha->records < hb->records ? a : b)->path, (unsigned long long)steps);
+            return 1;
+        }
+        previous = ha;
+        previous_skipped = 0;
+        skip_chunk(a, ha);
+        skip_chunk(b, hb);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char *paths[2] = { NULL, NULL };
+    int count = 0;
+    TraceFile a, b;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--context") == 0 && i + 1 < argc) {
+            context_size = atoi(argv[++i]);
+            if (context_size < 0 || context_size > MAX_CONTEXT) {
+                context_size = MAX_CONTEXT;
+            }
+        } else if (count < 2) {
+            paths[count++] = argv[i];
+        }
+    }
+
+    if (count != 2) {
+        printf("Program Usage: ./chip8-tracediff [--context n] a.trace b.trace\n");
+        exit(2);
+    }
+
+    if (open_trace(&a, paths[0]) != 0 || open_trace(&b, paths[1]) != 0) {
+        exit(2);
+    }
+    return compare(&a, &b);
+}